@@ -0,0 +1,65 @@
+#include "harness.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Stand-in for libFuzzer's main so the targets build with any compiler and
+// run under ctest. Replays the files and directories given, then runs
+// -runs=N inputs from random_text seeded with -seed=S, each at most
+// -max_len=L bytes. Flag names follow libFuzzer, so one test command works
+// with either driver.
+int main(int argc, char **argv) {
+  size_t runs = 0;
+  uint64_t seed = 1;
+  size_t max_len = 4096;
+  std::vector<std::string> inputs;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&](const std::string &flag) {
+      return std::strtoull(arg.c_str() + flag.size(), nullptr, 10);
+    };
+    if (arg.rfind("-runs=", 0) == 0) {
+      runs = value("-runs=");
+    } else if (arg.rfind("-seed=", 0) == 0) {
+      seed = value("-seed=");
+    } else if (arg.rfind("-max_len=", 0) == 0) {
+      max_len = value("-max_len=");
+    } else if (arg[0] == '-') {
+      std::cerr << "ignoring unsupported flag " << arg << std::endl;
+    } else if (std::filesystem::is_directory(arg)) {
+      std::vector<std::string> files;
+      for (const auto &entry : std::filesystem::directory_iterator(arg)) {
+        if (entry.is_regular_file())
+          files.push_back(entry.path().string());
+      }
+      std::sort(files.begin(), files.end());
+      inputs.insert(inputs.end(), files.begin(), files.end());
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  auto run = [](const std::string &input) {
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()),
+                           input.size());
+  };
+
+  for (const std::string &path : inputs) {
+    std::cerr << "Running " << path << std::endl;
+    run(harness::read_file(path));
+  }
+
+  std::mt19937_64 rng(seed);
+  for (size_t i = 0; i < runs; ++i)
+    run(harness::random_text(rng, max_len));
+
+  std::cerr << "Done " << inputs.size() + runs << " runs" << std::endl;
+  return 0;
+}
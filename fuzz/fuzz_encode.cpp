@@ -0,0 +1,26 @@
+#include "harness.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Every encode path of a trained model against the reference encoder, with
+// and without pre-tokenization.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string text(reinterpret_cast<const char *>(data), size);
+
+  for (bool pretokenize : {true, false}) {
+    harness::Fixture &fixture = harness::trained(pretokenize);
+    RBTokenizer &tokenizer = fixture.tokenizer;
+    harness::check_encoders(tokenizer, fixture.reference, text);
+
+    // Without dropout, dropout encoding is plain encoding. With it, a run
+    // is reproducible from its seed and still lossless.
+    RBPE_CHECK(tokenizer.encode_with_dropout(text, 0.0f, size) ==
+               fixture.reference.encode(text));
+    std::vector<int> dropped = tokenizer.encode_with_dropout(text, 0.5, size);
+    RBPE_CHECK(tokenizer.encode_with_dropout(text, 0.5, size) == dropped);
+    RBPE_CHECK(tokenizer.decode(dropped) == text);
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include "harness.h"
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+
+// The first byte picks the number of merges; the rest is the corpus. The
+// reference model is written out as a Hugging Face merges.txt and as a
+// tiktoken rank file, and both importers must read it back: the same
+// vocabulary, merges and encodings, and pre-tokenization turned on whatever
+// the tokenizer had before.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0)
+    return 0;
+  int vocab_size = 256 + data[0] % 128;
+  std::string text(reinterpret_cast<const char *>(data + 1), size - 1);
+  reference::Model model = reference::train(text, vocab_size, true);
+
+  std::map<int, std::pair<int, int>> by_id;
+  for (const auto &[pair, id] : model.merges)
+    by_id[id] = pair;
+
+  // load_hf_merges looks each half up by its bytes, so a merge of a token
+  // whose bytes a newer token also spells refers to the newer one.
+  harness::TempFile merges_file;
+  std::map<std::pair<int, int>, int> expected_merges;
+  {
+    std::ofstream out(merges_file.path(), std::ios::binary);
+    out << "#version: 0.2\n";
+    std::map<std::string, int> newest;
+    for (int i = 0; i < 256; ++i)
+      newest[model.vocab[i]] = i;
+    for (const auto &[id, pair] : by_id) {
+      const std::string &first = model.vocab[pair.first];
+      const std::string &second = model.vocab[pair.second];
+      out << reference::gpt2_unicode(first) << ' '
+          << reference::gpt2_unicode(second) << '\n';
+      expected_merges[{newest[first], newest[second]}] = id;
+      newest[model.vocab[id]] = id;
+    }
+  }
+
+  RBTokenizer hf(0, {}, false);
+  hf.load_hf_merges(merges_file.path());
+  RBPE_CHECK(hf.pretokenize);
+  RBPE_CHECK(hf.vocab.size() == model.vocab.size());
+  for (const auto &[id, bytes] : model.vocab)
+    RBPE_CHECK(hf.vocab.count(id) == 1 && hf.vocab[id] == bytes);
+  RBPE_CHECK(hf.merges.size() == expected_merges.size());
+  for (const auto &[pair, id] : expected_merges) {
+    auto it = hf.merges.find(pair);
+    RBPE_CHECK(it != hf.merges.end() && it->second == id);
+  }
+
+  reference::Encoder reference =
+      reference::Encoder::from_vocab(hf.vocab, true);
+  harness::force_parallel(hf);
+  harness::check_encoders(hf, reference, text);
+
+  // Ranks are the reference ids, byte tokens included.
+  harness::TempFile rank_file;
+  {
+    std::ofstream out(rank_file.path(), std::ios::binary);
+    for (const auto &[id, bytes] : model.vocab)
+      out << reference::base64(bytes) << ' ' << id << '\n';
+  }
+
+  RBTokenizer tiktoken(0, {}, false);
+  tiktoken.load_tiktoken(rank_file.path());
+  RBPE_CHECK(tiktoken.pretokenize);
+  RBPE_CHECK(tiktoken.merges.empty());
+  RBPE_CHECK(tiktoken.vocab == hf.vocab);
+
+  harness::force_parallel(tiktoken);
+  harness::check_encoders(tiktoken, reference, text);
+  return 0;
+}
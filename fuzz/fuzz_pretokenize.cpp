@@ -0,0 +1,35 @@
+#include "harness.h"
+#include "pretokenizer.h"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// PreTokenizer, SSE2 fast paths included, against the reference splitter,
+// and the safe boundaries used to encode large inputs in parallel.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view text(reinterpret_cast<const char *>(data), size);
+  std::vector<std::string_view> pieces = PreTokenizer::split(text);
+  RBPE_CHECK(pieces == reference::split(text));
+
+  size_t offset = 0;
+  for (std::string_view piece : pieces) {
+    RBPE_CHECK(!piece.empty());
+    RBPE_CHECK(piece.data() == text.data() + offset);
+    offset += piece.size();
+  }
+  RBPE_CHECK(offset == text.size());
+
+  for (size_t from = 0; from < text.size(); from += 1 + from / 2) {
+    size_t cut = PreTokenizer::find_safe_boundary(text, from);
+    if (cut == std::string_view::npos)
+      break;
+    RBPE_CHECK(cut >= from && cut > 0 && cut < text.size());
+
+    std::vector<std::string_view> halves = PreTokenizer::split(text.substr(0, cut));
+    std::vector<std::string_view> tail = PreTokenizer::split(text.substr(cut));
+    halves.insert(halves.end(), tail.begin(), tail.end());
+    RBPE_CHECK(halves == pieces);
+  }
+  return 0;
+}
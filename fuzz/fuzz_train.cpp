@@ -0,0 +1,75 @@
+#include "harness.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace {
+
+bool same_model(const RBTokenizer &tokenizer, const reference::Model &model) {
+  if (tokenizer.vocab.size() != model.vocab.size() ||
+      tokenizer.merges.size() != model.merges.size())
+    return false;
+  for (const auto &[id, bytes] : model.vocab) {
+    auto it = tokenizer.vocab.find(id);
+    if (it == tokenizer.vocab.end() || it->second != bytes)
+      return false;
+  }
+  for (const auto &[pair, id] : model.merges) {
+    auto it = tokenizer.merges.find(pair);
+    if (it == tokenizer.merges.end() || it->second != id)
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+// The first byte picks pre-tokenization and the number of merges; the rest
+// is the corpus. Training must match the full-recount reference trainer and
+// be repeatable, save/load must round-trip byte for byte, and the trained
+// and compacted models must encode like the reference encoder.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0)
+    return 0;
+  bool pretokenize = data[0] & 1;
+  int vocab_size = 256 + (data[0] >> 1);
+  std::string text(reinterpret_cast<const char *>(data + 1), size - 1);
+
+  RBTokenizer tokenizer(0, {}, pretokenize);
+  tokenizer.train(text, vocab_size);
+  RBPE_CHECK(same_model(tokenizer, reference::train(text, vocab_size,
+                                                    pretokenize)));
+
+  RBTokenizer again(0, {}, pretokenize);
+  again.train(text, vocab_size);
+  harness::TempFile first, second;
+  tokenizer.save(first.path());
+  again.save(second.path());
+  std::string saved = harness::read_file(first.path());
+  RBPE_CHECK(harness::read_file(second.path()) == saved);
+
+  RBTokenizer loaded(0, {}, pretokenize);
+  loaded.load(first.path());
+  harness::TempFile resaved;
+  loaded.save(resaved.path());
+  RBPE_CHECK(harness::read_file(resaved.path()) == saved);
+  RBPE_CHECK(loaded.vocab == tokenizer.vocab);
+  RBPE_CHECK(loaded.merges == tokenizer.merges);
+
+  reference::Encoder reference =
+      reference::Encoder::from_vocab(tokenizer.vocab, pretokenize);
+  harness::force_parallel(tokenizer);
+  harness::force_parallel(loaded);
+  harness::check_encoders(tokenizer, reference, text);
+  harness::check_encoders(loaded, reference, text);
+
+  tokenizer.compact(text, 2);
+  for (int id = 0; id < static_cast<int>(tokenizer.vocab.size()); ++id)
+    RBPE_CHECK(tokenizer.vocab.count(id) == 1);
+  harness::check_encoders(
+      tokenizer, reference::Encoder::from_vocab(tokenizer.vocab, pretokenize),
+      text);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "harness.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+int lookup(const std::map<std::string, int> &tokens, const std::string &key) {
+  auto it = tokens.find(key);
+  return it == tokens.end() ? -1 : it->second;
+}
+
+// True if some node below the root has no value and a single child, a hop
+// that insert and build should never create.
+bool has_chain(const CompressNode *node) {
+  for (const auto &[byte, child] : node->children) {
+    if ((child->value == -1 && child->children.size() == 1) ||
+        has_chain(child.get()))
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+// Each line of the input is a token. RadixBalancedTree::insert and build
+// must give the same chain-free tree and the lookups of a plain map, and
+// encoding the whole input over the inserted tree must match the reference
+// encoder.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string text(reinterpret_cast<const char *>(data), size);
+
+  std::vector<std::string> lines;
+  for (size_t start = 0; start < text.size() && lines.size() < 512;) {
+    size_t end = std::min(text.find('\n', start), text.size());
+    if (end > start)
+      lines.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+
+  RadixBalancedTree inserted;
+  std::map<std::string, int> tokens;
+  std::vector<std::pair<std::string, int>> sorted;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    int id = static_cast<int>(256 + i);
+    inserted.insert(lines[i], id);
+    tokens[lines[i]] = id;
+    sorted.push_back({lines[i], id});
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  RadixBalancedTree built;
+  built.build(sorted);
+  RBPE_CHECK(built.node_count() == inserted.node_count());
+  RBPE_CHECK(!has_chain(built.root.get()));
+  RBPE_CHECK(!has_chain(inserted.root.get()));
+
+  for (const std::string &line : lines) {
+    for (size_t len = 0; len <= line.size(); ++len) {
+      std::string key = line.substr(0, len);
+      int expected = len == 0 ? -1 : lookup(tokens, key);
+      RBPE_CHECK(inserted.get_id(key) == expected);
+      RBPE_CHECK(built.get_id(key) == expected);
+    }
+  }
+
+  for (bool pretokenize : {true, false}) {
+    RBTokenizer tokenizer(0, {}, pretokenize);
+    harness::force_parallel(tokenizer);
+    for (const auto &[bytes, id] : tokens) {
+      tokenizer.vocab[id] = bytes;
+      tokenizer.rbt->insert(bytes, id);
+    }
+    harness::check_encoders(
+        tokenizer, reference::Encoder(tokens, pretokenize), text);
+  }
+  return 0;
+}
@@ -0,0 +1,186 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "reference.h"
+#include "tokenizer.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Aborts with the failed expression, which libFuzzer and the sanitizers both
+// report as a crash with the offending input saved.
+#define RBPE_CHECK(cond)                                                       \
+  ((cond) ? (void)0 : harness::fail(#cond, __FILE__, __LINE__))
+
+namespace harness {
+
+[[noreturn]] inline void fail(const char *expr, const char *file, int line) {
+  std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+  std::abort();
+}
+
+// Text that exercises the pre-tokenizer: words, contractions, digit runs,
+// mixed whitespace, multi-byte and malformed UTF-8 and repeated fragments.
+inline std::string random_text(std::mt19937_64 &rng, size_t max_len) {
+  static const char *const kFragments[] = {
+      "the", "token", "Hello", "don", "'s", "'ll", "'re", "'d", "x", "BPE",
+      "radix", "aaaa", "abab", " ", "  ", "\n", "\t", " \n ", "\r\n", "0",
+      "42", "3.14", "!", "?", ".", ",", "()", "{}", "'", "\"", "-_", "//",
+      "\xC3\xA9", "\xC3\xBC", "\xE4\xB8\xAD\xE6\x96\x87", "\xF0\x9F\x98\x80",
+      "\xC2\xA0", "\xE2\x80\x83", "\xE3\x80\x81", "\xEF\xBC\x81", "\xC3",
+      "\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xE0\x80\xAF", "\xFF",
+  };
+  const size_t kCount = sizeof(kFragments) / sizeof(kFragments[0]);
+
+  size_t target = max_len == 0 ? 0 : rng() % (max_len + 1);
+  std::string text;
+  while (text.size() < target) {
+    switch (rng() % 8) {
+    case 0:
+      text += static_cast<char>(rng() % 256);
+      break;
+    case 1:
+      if (!text.empty()) {
+        size_t len = 1 + rng() % std::min<size_t>(text.size(), 16);
+        text += text.substr(text.size() - len);
+        break;
+      }
+      [[fallthrough]];
+    default:
+      text += kFragments[rng() % kCount];
+    }
+  }
+  text.resize(target);
+  return text;
+}
+
+inline std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+}
+
+// A file in the temp directory, removed when it goes out of scope.
+class TempFile {
+public:
+  TempFile() {
+    static int counter = 0;
+    path_ = (std::filesystem::temp_directory_path() /
+             ("rbpe_fuzz_" + std::to_string(getpid()) + "_" +
+              std::to_string(counter++)))
+                .string();
+  }
+  ~TempFile() { std::remove(path_.c_str()); }
+
+  TempFile(const TempFile &) = delete;
+  TempFile &operator=(const TempFile &) = delete;
+
+  const std::string &path() const { return path_; }
+
+private:
+  std::string path_;
+};
+
+// The parallel paths need more than one pool thread, and the shared pool
+// reads RBPE_NUM_THREADS once, when train or encode first uses it. Static
+// initialization runs before any target code, including with libFuzzer's
+// main. A value already in the environment is kept.
+inline const bool kPoolThreadsSet = setenv("RBPE_NUM_THREADS", "4", 0) == 0;
+
+// Makes every input long enough to take the parallel paths of encode and
+// count_tokens.
+inline void force_parallel(RBTokenizer &tokenizer) {
+  tokenizer.parallel_min_bytes = 1;
+  tokenizer.parallel_segment_bytes = 16;
+}
+
+// Longest token encode_with_dropout tries. Fixture models must not have
+// longer ones, so that dropout at probability 0 is a full longest match.
+inline constexpr int kMaxDepth = 32;
+
+struct Fixture {
+  RBTokenizer tokenizer;
+  reference::Encoder reference;
+
+  explicit Fixture(bool pretokenize)
+      : tokenizer(kMaxDepth, {}, pretokenize), reference({}, pretokenize) {
+    std::mt19937_64 rng(20240501);
+    std::string corpus;
+    while (corpus.size() < (64 << 10))
+      corpus += random_text(rng, 512);
+    tokenizer.train(corpus, 1024);
+    for (const auto &[id, bytes] : tokenizer.vocab)
+      RBPE_CHECK(bytes.size() <= static_cast<size_t>(kMaxDepth));
+    force_parallel(tokenizer);
+    reference = reference::Encoder::from_vocab(tokenizer.vocab, pretokenize);
+  }
+};
+
+// A model trained once per process on generated text.
+inline Fixture &trained(bool pretokenize) {
+  static Fixture with_pieces(true);
+  static Fixture without_pieces(false);
+  return pretokenize ? with_pieces : without_pieces;
+}
+
+// Checks every encode entry point of tokenizer against the reference
+// encoder, and that decoding gives back text.
+inline void check_encoders(RBTokenizer &tokenizer,
+                           const reference::Encoder &reference,
+                           std::string_view text) {
+  std::vector<int> expected = reference.encode(text);
+
+  RBPE_CHECK(tokenizer.decode(expected) == text);
+  RBPE_CHECK(tokenizer.encode(text) == expected);
+  RBPE_CHECK(tokenizer.count_tokens(text) == expected.size());
+  RBPE_CHECK(tokenizer.batch_encode({std::string(text)}).front() == expected);
+
+  std::vector<int> ids;
+  RBPE_CHECK(tokenizer.encode_into(text, ids) == expected.size());
+  RBPE_CHECK(ids == expected);
+
+  for (size_t max_tokens :
+       {size_t(0), size_t(1), expected.size() / 2, expected.size() + 1}) {
+    std::vector<int> prefix(
+        expected.begin(),
+        expected.begin() + std::min(max_tokens, expected.size()));
+    RBPE_CHECK(tokenizer.encode(text, max_tokens) == prefix);
+  }
+
+  // Resumable encoding into buffers too small for the whole text. A buffer
+  // that cannot hold the next piece is doubled, as a caller would.
+  for (size_t capacity : {size_t(1), size_t(3), size_t(16)}) {
+    std::vector<int> buffer(capacity);
+    std::vector<int> resumed;
+    std::string_view rest = text;
+    while (true) {
+      EncodeStatus status =
+          tokenizer.encode_into(rest, buffer.data(), buffer.size());
+      resumed.insert(resumed.end(), buffer.begin(),
+                     buffer.begin() + status.count);
+      RBPE_CHECK(status.consumed <= rest.size());
+      rest = rest.substr(status.consumed);
+      if (status.complete)
+        break;
+      if (status.count == 0)
+        buffer.resize(buffer.size() * 2);
+    }
+    RBPE_CHECK(rest.empty());
+    RBPE_CHECK(resumed == expected);
+  }
+}
+
+} // namespace harness
+
+#endif // HARNESS_H
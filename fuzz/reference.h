@@ -0,0 +1,306 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Plain implementations of what the tokenizer is specified to do. The fuzz
+// targets compare every fast path against these, so they trade all speed for
+// being easy to check by reading: no SIMD, no trie, no incremental counts.
+namespace reference {
+
+enum Class { kLetter, kDigit, kSpace, kOther };
+
+struct CodePoint {
+  size_t offset;
+  size_t length;
+  Class cls;
+};
+
+inline Class classify(uint32_t cp) {
+  if (cp < 0x80) {
+    if ((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z'))
+      return kLetter;
+    if (cp >= '0' && cp <= '9')
+      return kDigit;
+    if (cp == ' ' || (cp >= '\t' && cp <= '\r'))
+      return kSpace;
+    return kOther;
+  }
+  if (cp == 0x85 || cp == 0xA0 || cp == 0x1680 ||
+      (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029 ||
+      cp == 0x202F || cp == 0x205F || cp == 0x3000)
+    return kSpace;
+  if (cp <= 0xBF || (cp >= 0x2010 && cp <= 0x206F) ||
+      (cp >= 0x3001 && cp <= 0x303F) || (cp >= 0xFF01 && cp <= 0xFF0F))
+    return kOther;
+  return kLetter;
+}
+
+// Decodes text into code points. Bytes that do not start a well-formed
+// UTF-8 sequence become one-byte kOther code points.
+inline std::vector<CodePoint> decode_utf8(std::string_view text) {
+  std::vector<CodePoint> out;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    uint8_t lead = static_cast<uint8_t>(text[pos]);
+    size_t length = 0;
+    uint32_t cp = 0;
+    if (lead < 0x80) {
+      length = 1;
+      cp = lead;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+      length = 2;
+      cp = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+      length = 3;
+      cp = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+      length = 4;
+      cp = lead & 0x07;
+    }
+
+    bool valid = length > 0 && pos + length <= text.size();
+    for (size_t k = 1; valid && k < length; ++k) {
+      uint8_t byte = static_cast<uint8_t>(text[pos + k]);
+      valid = (byte & 0xC0) == 0x80;
+      cp = (cp << 6) | (byte & 0x3F);
+    }
+    if (valid && ((length == 3 && cp < 0x800) ||
+                  (length == 4 && cp < 0x10000) ||
+                  (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF))
+      valid = false;
+
+    if (valid) {
+      out.push_back({pos, length, classify(cp)});
+      pos += length;
+    } else {
+      out.push_back({pos, 1, kOther});
+      pos += 1;
+    }
+  }
+  return out;
+}
+
+// The GPT-2 pattern, tried alternative by alternative at each code point:
+//   's|'t|'re|'ve|'m|'ll|'d| ?L+| ?N+| ?[^\sLN]+|\s+(?!\S)|\s+
+inline std::vector<std::string_view> split(std::string_view text) {
+  std::vector<CodePoint> cps = decode_utf8(text);
+  size_t n = cps.size();
+  auto is = [&](size_t i, char c) {
+    return i < n && cps[i].length == 1 && text[cps[i].offset] == c;
+  };
+  auto run_end = [&](size_t i, Class cls) {
+    while (i < n && cps[i].cls == cls)
+      i++;
+    return i;
+  };
+
+  std::vector<std::string_view> pieces;
+  size_t i = 0;
+  while (i < n) {
+    size_t end = i;
+    if (is(i, '\'') && (is(i + 1, 's') || is(i + 1, 't') || is(i + 1, 'm') ||
+                        is(i + 1, 'd'))) {
+      end = i + 2;
+    } else if (is(i, '\'') && ((is(i + 1, 'r') && is(i + 2, 'e')) ||
+                               (is(i + 1, 'v') && is(i + 2, 'e')) ||
+                               (is(i + 1, 'l') && is(i + 2, 'l')))) {
+      end = i + 3;
+    } else {
+      size_t start = is(i, ' ') && i + 1 < n && cps[i + 1].cls != kSpace
+                         ? i + 1
+                         : i;
+      Class cls = cps[start].cls;
+      if (cls != kSpace) {
+        end = run_end(start, cls);
+      } else {
+        end = run_end(i, kSpace);
+        if (end < n && end - i > 1)
+          end--; // leave the last space to the next word
+      }
+    }
+
+    size_t begin = cps[i].offset;
+    size_t stop = end < n ? cps[end].offset : text.size();
+    pieces.push_back(text.substr(begin, stop - begin));
+    i = end;
+  }
+  return pieces;
+}
+
+// Greedy longest match over a token table, piece by piece. Bytes that start
+// no token are emitted as their byte value.
+class Encoder {
+public:
+  Encoder(std::map<std::string, int> tokens, bool pretokenize)
+      : tokens_(std::move(tokens)), pretokenize_(pretokenize) {
+    for (const auto &[bytes, id] : tokens_)
+      max_length_ = std::max(max_length_, bytes.size());
+  }
+
+  // Tokens of a trained vocabulary: every merged id, the newest winning
+  // when two merges spell the same bytes.
+  static Encoder from_vocab(const std::unordered_map<int, std::string> &vocab,
+                            bool pretokenize) {
+    std::map<std::string, int> tokens;
+    for (const auto &[id, bytes] : vocab) {
+      if (id < 256)
+        continue;
+      auto it = tokens.find(bytes);
+      if (it == tokens.end() || it->second < id)
+        tokens[bytes] = id;
+    }
+    return Encoder(std::move(tokens), pretokenize);
+  }
+
+  std::vector<int> encode(std::string_view text) const {
+    std::vector<int> ids;
+    if (!pretokenize_) {
+      encode_piece(text, ids);
+      return ids;
+    }
+    for (std::string_view piece : split(text))
+      encode_piece(piece, ids);
+    return ids;
+  }
+
+private:
+  std::map<std::string, int> tokens_;
+  bool pretokenize_;
+  size_t max_length_ = 0;
+
+  void encode_piece(std::string_view piece, std::vector<int> &ids) const {
+    size_t pos = 0;
+    while (pos < piece.size()) {
+      size_t length = std::min(max_length_, piece.size() - pos);
+      for (; length > 0; --length) {
+        auto it = tokens_.find(std::string(piece.substr(pos, length)));
+        if (it != tokens_.end()) {
+          ids.push_back(it->second);
+          break;
+        }
+      }
+      if (length == 0) {
+        ids.push_back(static_cast<uint8_t>(piece[pos]));
+        length = 1;
+      }
+      pos += length;
+    }
+  }
+};
+
+struct Model {
+  std::map<int, std::string> vocab;
+  std::map<std::pair<int, int>, int> merges;
+};
+
+// Byte-level BPE by full recount: every round counts all adjacent pairs
+// within each piece, merges the most frequent one (the smallest pair on
+// ties) left to right, and gives it the next id.
+inline Model train(std::string_view text, int vocab_size, bool pretokenize) {
+  Model model;
+  for (int i = 0; i < 256; ++i)
+    model.vocab[i] = std::string(1, static_cast<char>(i));
+
+  std::vector<std::vector<int>> words;
+  std::vector<std::string_view> pieces =
+      pretokenize ? split(text) : std::vector<std::string_view>{text};
+  for (std::string_view piece : pieces) {
+    std::vector<int> word;
+    for (char c : piece)
+      word.push_back(static_cast<uint8_t>(c));
+    words.push_back(word);
+  }
+
+  while (static_cast<int>(model.vocab.size()) < vocab_size) {
+    std::map<std::pair<int, int>, int> counts;
+    for (const auto &word : words) {
+      for (size_t i = 0; i + 1 < word.size(); ++i)
+        counts[{word[i], word[i + 1]}]++;
+    }
+    if (counts.empty())
+      break;
+
+    std::pair<int, int> best = counts.begin()->first;
+    for (const auto &[pair, count] : counts) {
+      if (count > counts[best])
+        best = pair;
+    }
+
+    int new_id = static_cast<int>(model.vocab.size());
+    model.merges[best] = new_id;
+    model.vocab[new_id] = model.vocab[best.first] + model.vocab[best.second];
+
+    for (auto &word : words) {
+      std::vector<int> merged;
+      for (size_t i = 0; i < word.size(); ++i) {
+        if (i + 1 < word.size() && word[i] == best.first &&
+            word[i + 1] == best.second) {
+          merged.push_back(new_id);
+          i++;
+        } else {
+          merged.push_back(word[i]);
+        }
+      }
+      word = std::move(merged);
+    }
+  }
+  return model;
+}
+
+// Standard base64 with padding, as in tiktoken rank files.
+inline std::string base64(std::string_view bytes) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    uint32_t group = 0;
+    size_t n = std::min<size_t>(3, bytes.size() - i);
+    for (size_t k = 0; k < 3; ++k)
+      group = (group << 8) |
+              (k < n ? static_cast<uint8_t>(bytes[i + k]) : 0);
+    for (size_t k = 0; k < 4; ++k)
+      out += k <= n ? kAlphabet[(group >> (18 - 6 * k)) & 0x3F] : '=';
+  }
+  return out;
+}
+
+// GPT-2's byte-to-unicode alphabet, as in Hugging Face merges.txt: printable
+// Latin-1 bytes stand for themselves and the other 68 bytes, in order, for
+// U+0100 onwards. Each code point is written as UTF-8.
+inline std::string gpt2_unicode(std::string_view bytes) {
+  std::string out;
+  for (char c : bytes) {
+    uint32_t b = static_cast<uint8_t>(c);
+    uint32_t cp = b;
+    if (!((b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) ||
+          (b >= 0xAE && b <= 0xFF))) {
+      cp = 256;
+      for (uint32_t other = 0; other < b; ++other) {
+        if (!((other >= '!' && other <= '~') ||
+              (other >= 0xA1 && other <= 0xAC) ||
+              (other >= 0xAE && other <= 0xFF)))
+          cp++;
+      }
+    }
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    } else {
+      out += static_cast<char>(0xC0 | (cp >> 6));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+  }
+  return out;
+}
+
+} // namespace reference
+
+#endif // REFERENCE_H
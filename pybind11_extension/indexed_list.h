@@ -2,10 +2,14 @@
 #define INDEXED_LIST_H
 
 #include "pair_hash.h"
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 class IndexedList {
 public:
@@ -13,29 +17,25 @@ public:
     int val;
     Node *prev;
     Node *next;
+    // True when this node starts a new pre-token; it never pairs with prev.
+    bool boundary;
 
-    Node(int v) : val(v), prev(nullptr), next(nullptr) {}
+    Node(int v) : val(v), prev(nullptr), next(nullptr), boundary(false) {}
   };
 
   IndexedList(const std::vector<uint8_t> &bytes) {
-    if (bytes.empty()) {
-      head = nullptr;
-      tail = nullptr;
-      size_ = 0;
-      return;
+    for (uint8_t byte : bytes) {
+      append(byte, false);
     }
-    head = new Node(bytes[0]);
-    Node *current = head;
-    for (size_t i = 1; i < bytes.size(); i++) {
-      Node *newNode = new Node(bytes[i]);
-      newNode->prev = current;
-      current->next = newNode;
-      current = newNode;
+  }
 
-      add_to_index(current->prev->val, current->val, current->prev);
+  // Builds the list from pre-tokenized pieces; pairs never span two pieces.
+  IndexedList(const std::vector<std::string_view> &pieces) {
+    for (const auto &piece : pieces) {
+      for (size_t i = 0; i < piece.size(); i++) {
+        append(static_cast<uint8_t>(piece[i]), i == 0);
+      }
     }
-    tail = current;
-    size_ = bytes.size();
   }
 
   ~IndexedList() {
@@ -45,26 +45,42 @@ public:
       delete current;
       current = next;
     }
+    for (Node *node : retired) {
+      delete node;
+    }
   }
 
   std::vector<Node *> &get_pair_positions(const std::pair<int, int> &pair) {
     return pair_index[pair];
   }
 
+  // Takes a node that has been unlinked from the list. Pair positions may
+  // still point at it, so it is kept until the list is destroyed, with a
+  // value no pair can match.
+  void retire(Node *node) {
+    node->val = -1;
+    node->prev = nullptr;
+    node->next = nullptr;
+    retired.push_back(node);
+  }
+
   void update_index(Node *node) {
+    bool pairs_prev = node->prev && !node->boundary;
+    bool pairs_next = node->next && !node->next->boundary;
+
     // Removing old pairs
-    if (node->prev) {
+    if (pairs_prev) {
       remove_from_index(node->prev->val, node->val, node->prev);
     }
-    if (node->next) {
+    if (pairs_next) {
       remove_from_index(node->val, node->next->val, node);
     }
 
     // Adding new pairs
-    if (node->prev) {
+    if (pairs_prev) {
       add_to_index(node->prev->val, node->val, node->prev);
     }
-    if (node->next) {
+    if (pairs_next) {
       add_to_index(node->val, node->next->val, node);
     }
   }
@@ -76,6 +92,23 @@ public:
 private:
   std::unordered_map<std::pair<int, int>, std::vector<Node *>, pair_hash>
       pair_index;
+  std::vector<Node *> retired;
+
+  void append(int val, bool boundary) {
+    Node *node = new Node(val);
+    node->boundary = boundary;
+    if (!head) {
+      head = node;
+    } else {
+      node->prev = tail;
+      tail->next = node;
+      if (!boundary) {
+        add_to_index(tail->val, node->val, tail);
+      }
+    }
+    tail = node;
+    size_++;
+  }
 
   void add_to_index(int first, int second, Node *node) {
     auto key = std::make_pair(first, second);
@@ -46,10 +46,14 @@ public:
   bool empty() const { return counts_.empty(); }
 
 private:
+  // Max-heap on count; equal counts pop the lexicographically smallest
+  // pair first, so max() never depends on insertion order.
   struct Compare {
     bool operator()(const std::pair<std::pair<int, int>, int> &a,
                     const std::pair<std::pair<int, int>, int> &b) {
-      return a.second < b.second; // Max-heap
+      if (a.second != b.second)
+        return a.second < b.second;
+      return a.first > b.first;
     }
   };
 
@@ -0,0 +1,132 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "thread_pool.h"
+#include "tokenizer.h"
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// One tokenized batch. Entry i holds the ids of one text, or of one chunk of
+// a text when chunking is on, the decoded text to hand to an embedder and the
+// index of the input text it came from.
+struct TokenizedBatch {
+  std::vector<std::vector<int>> tokens;
+  std::vector<std::string> texts;
+  std::vector<size_t> source;
+};
+
+// Runs encode, optional chunk_with_overlap and decode-for-embedding on the
+// shared pool so the caller can embed one batch while the next ones are
+// being tokenized. At most max_in_flight batches are processed at once;
+// submit blocks beyond that. A chunk_size above 0 turns chunking on and
+// needs 0 <= overlap < chunk_size.
+class TokenizePipeline {
+public:
+  TokenizePipeline(RBTokenizer &tokenizer, size_t max_in_flight = 4,
+                   int chunk_size = 0, int overlap = 64)
+      : tokenizer_(tokenizer), max_in_flight_(std::max<size_t>(max_in_flight, 1)),
+        chunk_size_(chunk_size), overlap_(overlap),
+        state_(std::make_shared<State>()) {
+    if (chunk_size > 0 && (overlap < 0 || overlap >= chunk_size))
+      throw std::invalid_argument(
+          "TokenizePipeline needs 0 <= overlap < chunk_size when chunking");
+  }
+
+  ~TokenizePipeline() { wait_idle(); }
+
+  TokenizePipeline(const TokenizePipeline &) = delete;
+  TokenizePipeline &operator=(const TokenizePipeline &) = delete;
+
+  size_t max_in_flight() const { return max_in_flight_; }
+
+  // dropout_probs is empty or has one probability per text; texts with a
+  // probability above 0 go through encode_with_dropout.
+  std::shared_future<TokenizedBatch>
+  submit(std::vector<std::string> texts, std::vector<float> dropout_probs = {}) {
+    {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      state_->changed.wait(
+          lock, [&] { return state_->in_flight < max_in_flight_; });
+      state_->in_flight++;
+    }
+
+    auto promise = std::make_shared<std::promise<TokenizedBatch>>();
+    std::shared_future<TokenizedBatch> future = promise->get_future().share();
+    auto job = std::make_shared<Job>(Job{std::move(texts),
+                                         std::move(dropout_probs)});
+    auto state = state_;
+
+    WorkStealingPool::shared().submit([this, job, promise, state] {
+      try {
+        promise->set_value(run(*job));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+      std::lock_guard<std::mutex> lock(state->mtx);
+      state->in_flight--;
+      state->changed.notify_all();
+    });
+    return future;
+  }
+
+  // Blocks until every submitted batch has finished.
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(state_->mtx);
+    state_->changed.wait(lock, [&] { return state_->in_flight == 0; });
+  }
+
+private:
+  struct Job {
+    std::vector<std::string> texts;
+    std::vector<float> dropout_probs;
+  };
+
+  struct State {
+    std::mutex mtx;
+    std::condition_variable changed;
+    size_t in_flight = 0;
+  };
+
+  RBTokenizer &tokenizer_;
+  size_t max_in_flight_;
+  int chunk_size_;
+  int overlap_;
+  std::shared_ptr<State> state_;
+
+  TokenizedBatch run(const Job &job) {
+    std::vector<std::vector<std::vector<int>>> per_text(job.texts.size());
+    WorkStealingPool::shared().parallel_for(job.texts.size(), [&](size_t i) {
+      float dropout = i < job.dropout_probs.size() ? job.dropout_probs[i] : 0;
+      if (dropout > 0) {
+        per_text[i].push_back(
+            tokenizer_.encode_with_dropout(job.texts[i], dropout));
+      } else if (chunk_size_ > 0) {
+        per_text[i] =
+            tokenizer_.chunk_with_overlap(job.texts[i], chunk_size_, overlap_);
+      } else {
+        per_text[i].push_back(tokenizer_.encode(job.texts[i]));
+      }
+    });
+
+    TokenizedBatch batch;
+    for (size_t i = 0; i < per_text.size(); ++i) {
+      for (auto &tokens : per_text[i]) {
+        batch.tokens.push_back(std::move(tokens));
+        batch.source.push_back(i);
+      }
+    }
+    batch.texts.resize(batch.tokens.size());
+    WorkStealingPool::shared().parallel_for(batch.tokens.size(), [&](size_t i) {
+      batch.texts[i] = tokenizer_.decode(batch.tokens[i]);
+    });
+    return batch;
+  }
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,256 @@
+#ifndef PRETOKENIZER_H
+#define PRETOKENIZER_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Splits text into GPT-2 style pieces before BPE ever sees it:
+//   's|'t|'re|'ve|'m|'ll|'d| ?L+| ?N+| ?[^\sLN]+|\s+(?!\S)|\s+
+// Pieces are string_views into the input and always end on a code point
+// boundary. Non-ASCII code points are classified as letters, except for the
+// common Unicode whitespace and punctuation blocks; malformed UTF-8 bytes are
+// treated as single punctuation bytes.
+class PreTokenizer {
+public:
+  enum ByteClass : uint8_t {
+    kOther = 0,
+    kLetter,
+    kDigit,
+    kSpace,
+    kLead2,
+    kLead3,
+    kLead4,
+    kContinuation,
+  };
+
+  static uint8_t byte_class(uint8_t byte) { return table()[byte]; }
+
+  // Calls fn(std::string_view) for every piece of text, in order.
+  template <typename Fn> static void for_each(std::string_view text, Fn &&fn) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t end = next_piece(text, pos);
+      fn(text.substr(pos, end - pos));
+      pos = end;
+    }
+  }
+
+  static std::vector<std::string_view> split(std::string_view text) {
+    std::vector<std::string_view> pieces;
+    for_each(text, [&](std::string_view piece) { pieces.push_back(piece); });
+    return pieces;
+  }
+
+  // Returns the end offset of the piece starting at pos.
+  static size_t next_piece(std::string_view text, size_t pos) {
+    const auto *data = reinterpret_cast<const uint8_t *>(text.data());
+    const size_t n = text.size();
+
+    if (data[pos] == '\'') {
+      size_t len = contraction_length(data + pos, n - pos);
+      if (len)
+        return pos + len;
+    }
+
+    size_t start = pos;
+    if (data[pos] == ' ' && pos + 1 < n) {
+      size_t ignored;
+      if (code_point_class(data + pos + 1, n - pos - 1, ignored) != kSpace)
+        start = pos + 1;
+    }
+
+    size_t len;
+    uint8_t cls = code_point_class(data + start, n - start, len);
+    switch (cls) {
+    case kLetter:
+      return scan_letters(data, start, n);
+    case kDigit:
+      return scan_digits(data, start, n);
+    case kSpace:
+      return scan_whitespace(data, pos, n);
+    default:
+      return scan_class(data, start, n, kOther);
+    }
+  }
+
+  // Returns the first offset >= from at which every segmentation of text
+  // has a piece boundary, or npos if none exists. An ASCII letter or digit
+  // always ends its piece when followed by an ASCII byte of another class,
+  // so splitting there and pre-tokenizing both halves independently yields
+  // exactly the pieces of the whole.
+  static size_t find_safe_boundary(std::string_view text, size_t from) {
+    const auto *data = reinterpret_cast<const uint8_t *>(text.data());
+    for (size_t pos = std::max<size_t>(from, 1); pos < text.size(); ++pos) {
+      uint8_t before = table()[data[pos - 1]];
+      if ((before == kLetter || before == kDigit) && data[pos] < 0x80 &&
+          table()[data[pos]] != before)
+        return pos;
+    }
+    return std::string_view::npos;
+  }
+
+private:
+  static constexpr std::array<uint8_t, 256> build_table() {
+    std::array<uint8_t, 256> table{};
+    for (int b = 0; b < 256; ++b) {
+      uint8_t cls = kOther;
+      if ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z'))
+        cls = kLetter;
+      else if (b >= '0' && b <= '9')
+        cls = kDigit;
+      else if (b == ' ' || (b >= '\t' && b <= '\r'))
+        cls = kSpace;
+      else if (b >= 0x80 && b <= 0xBF)
+        cls = kContinuation;
+      else if (b >= 0xC2 && b <= 0xDF)
+        cls = kLead2;
+      else if (b >= 0xE0 && b <= 0xEF)
+        cls = kLead3;
+      else if (b >= 0xF0 && b <= 0xF4)
+        cls = kLead4;
+      table[b] = cls;
+    }
+    return table;
+  }
+
+  static const std::array<uint8_t, 256> &table() {
+    static constexpr std::array<uint8_t, 256> kTable = build_table();
+    return kTable;
+  }
+
+  static uint8_t classify_code_point(uint32_t cp) {
+    if (cp == 0x85 || cp == 0xA0 || cp == 0x1680 ||
+        (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029 ||
+        cp == 0x202F || cp == 0x205F || cp == 0x3000)
+      return kSpace;
+    if ((cp >= 0x80 && cp <= 0xBF) || (cp >= 0x2010 && cp <= 0x206F) ||
+        (cp >= 0x3001 && cp <= 0x303F) || (cp >= 0xFF01 && cp <= 0xFF0F))
+      return kOther;
+    return kLetter;
+  }
+
+  // Classifies the code point at p and stores its encoded length in len.
+  // Truncated or malformed sequences are one-byte kOther code points.
+  static uint8_t code_point_class(const uint8_t *p, size_t remaining,
+                                  size_t &len) {
+    uint8_t cls = table()[p[0]];
+    if (cls < kLead2) {
+      len = 1;
+      return cls;
+    }
+    size_t need = cls == kLead2 ? 2 : cls == kLead3 ? 3 : cls == kLead4 ? 4 : 0;
+    if (need == 0 || need > remaining) {
+      len = 1;
+      return kOther;
+    }
+    uint32_t cp = p[0] & (0x7F >> need);
+    for (size_t k = 1; k < need; ++k) {
+      if (table()[p[k]] != kContinuation) {
+        len = 1;
+        return kOther;
+      }
+      cp = (cp << 6) | (p[k] & 0x3F);
+    }
+    // Reject overlong encodings, surrogates and values above U+10FFFF.
+    if ((need == 3 && cp < 0x800) || (need == 4 && cp < 0x10000) ||
+        (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+      len = 1;
+      return kOther;
+    }
+    len = need;
+    return classify_code_point(cp);
+  }
+
+  static size_t contraction_length(const uint8_t *p, size_t remaining) {
+    if (remaining < 2)
+      return 0;
+    uint8_t c1 = p[1];
+    if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd')
+      return 2;
+    if (remaining >= 3) {
+      uint8_t c2 = p[2];
+      if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') ||
+          (c1 == 'l' && c2 == 'l'))
+        return 3;
+    }
+    return 0;
+  }
+
+  static size_t scan_class(const uint8_t *data, size_t pos, size_t n,
+                           uint8_t cls) {
+    size_t len;
+    while (pos < n && code_point_class(data + pos, n - pos, len) == cls)
+      pos += len;
+    return pos;
+  }
+
+#if defined(__SSE2__)
+  // Advances over ASCII bytes in [lo, lo + span) sixteen at a time.
+  static size_t skip_ascii_range(const uint8_t *data, size_t pos, size_t n,
+                                 uint8_t fold, uint8_t lo, uint8_t span) {
+    const __m128i fold_v = _mm_set1_epi8(static_cast<char>(fold));
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80 - lo));
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(0x80 + span));
+    while (pos + 16 <= n) {
+      __m128i chunk =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+      chunk = _mm_add_epi8(_mm_or_si128(chunk, fold_v), bias);
+      unsigned mask =
+          static_cast<unsigned>(_mm_movemask_epi8(_mm_cmplt_epi8(chunk, limit)));
+      if (mask != 0xFFFF)
+        return pos + __builtin_ctz(~mask);
+      pos += 16;
+    }
+    return pos;
+  }
+#endif
+
+  static size_t scan_letters(const uint8_t *data, size_t pos, size_t n) {
+    size_t len;
+    while (pos < n) {
+#if defined(__SSE2__)
+      pos = skip_ascii_range(data, pos, n, 0x20, 'a', 26);
+      if (pos >= n)
+        break;
+#endif
+      if (code_point_class(data + pos, n - pos, len) != kLetter)
+        break;
+      pos += len;
+    }
+    return pos;
+  }
+
+  static size_t scan_digits(const uint8_t *data, size_t pos, size_t n) {
+#if defined(__SSE2__)
+    pos = skip_ascii_range(data, pos, n, 0x00, '0', 10);
+#endif
+    while (pos < n && table()[data[pos]] == kDigit)
+      ++pos;
+    return pos;
+  }
+
+  // \s+(?!\S)|\s+ : a whitespace run followed by a non-space code point gives
+  // up its last code point, so " word" stays together.
+  static size_t scan_whitespace(const uint8_t *data, size_t pos, size_t n) {
+    size_t end = pos;
+    size_t last = pos;
+    size_t len;
+    while (end < n && code_point_class(data + end, n - end, len) == kSpace) {
+      last = end;
+      end += len;
+    }
+    if (end < n && last > pos)
+      return last;
+    return end;
+  }
+};
+
+#endif // PRETOKENIZER_H
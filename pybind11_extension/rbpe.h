@@ -2,99 +2,144 @@
 #define Rbpe_H
 
 #include <algorithm>
-#include <chrono>
 #include <cstddef>
-#include <ctime>
+#include <cstdint>
 #include <deque>
 #include <memory>
-#include <mutex>
 #include <stdio.h>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 class CompressNode {
 public:
   std::string prefix;
   std::unordered_map<uint8_t, std::shared_ptr<CompressNode>> children;
-  int count;
   int value;
-  time_t last_accessed;
 
-  CompressNode(const std::string &prefix)
-      : prefix(prefix), count(0), value(-1), last_accessed(std::time(nullptr)) {
-  }
-
-private:
-  static double current_time() {
-    return std::chrono::duration<double>(
-               std::chrono::system_clock::now().time_since_epoch())
-        .count();
-  }
+  CompressNode(const std::string &prefix) : prefix(prefix), value(-1) {}
 };
 
+// Compressed trie over token bytes. Nodes live in an arena owned by the
+// tree; the shared_ptrs handed out alias the arena, so building a tree costs
+// no per-node allocation beyond the node's prefix and children table.
 class RadixBalancedTree {
 public:
   std::shared_ptr<CompressNode> root;
-  RadixBalancedTree(size_t max_cache_size = 1024)
-      : root(std::make_shared<CompressNode>("")),
-        max_cache_size(max_cache_size) {
-    for (int i = 0; i < 256; ++i) {
-      byte_to_id[std::string(1, (char)i)] = i;
-    }
+  RadixBalancedTree()
+      : arena(std::make_shared<std::deque<CompressNode>>()) {
+    root = make_node("");
   }
 
+  ~RadixBalancedTree() { release(); }
+
+  RadixBalancedTree(const RadixBalancedTree &) = delete;
+  RadixBalancedTree &operator=(const RadixBalancedTree &) = delete;
+
   int insert(const std::string &token_bytes, int token_id) {
     auto node = root;
     size_t i = 0;
 
     while (i < token_bytes.size()) {
       uint8_t byte = static_cast<uint8_t>(token_bytes[i]);
-      if (node->children.count(byte)) {
-        auto child = node->children[byte];
-        size_t prefix_len = child->prefix.size();
-
-        if (token_bytes.substr(i, prefix_len) == child->prefix) {
-          node = child;
-          i += prefix_len;
-        } else {
-          size_t common_len = 0;
-          size_t max_len = std::min(prefix_len, token_bytes.size() - 1);
-
-          while (common_len < max_len &&
-                 child->prefix[common_len] == token_bytes[i + common_len]) {
-            common_len++;
-          }
-
-          auto split_node = std::make_shared<CompressNode>(
-              child->prefix.substr(0, common_len));
-          child->prefix = child->prefix.substr(common_len);
-          uint8_t child_first_byte = static_cast<uint8_t>(child->prefix[0]);
-          split_node->children[child_first_byte] = child;
-
-          std::string new_prefix = token_bytes.substr(i + common_len);
-          auto new_node = std::make_shared<CompressNode>(new_prefix);
-          new_node->value = token_id;
-          uint8_t new_prefix_first_byte = static_cast<uint8_t>(new_prefix[0]);
-          split_node->children[new_prefix_first_byte] = new_node;
-          node->children[byte] = split_node;
-          node = new_node;
-          i += common_len;
-          break;
-        }
-      } else {
-        auto new_node = std::make_shared<CompressNode>(token_bytes.substr(i));
-        new_node->value = token_id;
+      auto it = node->children.find(byte);
+      if (it == node->children.end()) {
+        auto new_node = make_node(token_bytes.substr(i));
         node->children[byte] = new_node;
         node = new_node;
-        i = token_bytes.size();
         break;
       }
+
+      auto child = it->second;
+      size_t prefix_len = child->prefix.size();
+      size_t max_len = std::min(prefix_len, token_bytes.size() - i);
+      size_t common_len = 0;
+      while (common_len < max_len &&
+             child->prefix[common_len] == token_bytes[i + common_len]) {
+        common_len++;
+      }
+
+      if (common_len == prefix_len) {
+        node = child;
+        i += prefix_len;
+        continue;
+      }
+
+      // The token diverges from, or ends inside, the child's prefix.
+      auto split_node = make_node(child->prefix.substr(0, common_len));
+      child->prefix = child->prefix.substr(common_len);
+      split_node->children[static_cast<uint8_t>(child->prefix[0])] = child;
+      it->second = split_node;
+      i += common_len;
+
+      node = split_node;
+      if (i < token_bytes.size()) {
+        auto new_node = make_node(token_bytes.substr(i));
+        split_node->children[static_cast<uint8_t>(token_bytes[i])] = new_node;
+        node = new_node;
+      }
+      break;
     }
     node->value = token_id;
-    id_map[token_id] = token_bytes;
     return token_id;
   }
 
+  // Replaces the tree with one holding tokens, which must be sorted by
+  // bytes. Built in a single pass: each token shares the path of its longest
+  // common prefix with the previous one, so only that edge may need a split.
+  // For duplicate byte strings the last entry wins, as with insert.
+  void build(const std::vector<std::pair<std::string, int>> &tokens) {
+    release();
+    arena = std::make_shared<std::deque<CompressNode>>();
+    root = make_node("");
+
+    // Path to the previous token as (node, depth at the end of its prefix).
+    std::vector<std::pair<std::shared_ptr<CompressNode>, size_t>> path{
+        {root, 0}};
+    const std::string *previous = nullptr;
+
+    for (const auto &[bytes, id] : tokens) {
+      if (bytes.empty())
+        continue;
+
+      size_t lcp = 0;
+      if (previous) {
+        size_t max_len = std::min(previous->size(), bytes.size());
+        while (lcp < max_len && (*previous)[lcp] == bytes[lcp])
+          lcp++;
+      }
+
+      std::shared_ptr<CompressNode> cut;
+      while (path.back().second > lcp) {
+        cut = path.back().first;
+        path.pop_back();
+      }
+
+      auto &[parent, depth] = path.back();
+      if (depth < lcp) {
+        // The shared prefix ends inside the edge to cut.
+        size_t keep = lcp - depth;
+        auto split_node = make_node(cut->prefix.substr(0, keep));
+        cut->prefix = cut->prefix.substr(keep);
+        split_node->children[static_cast<uint8_t>(cut->prefix[0])] = cut;
+        parent->children[static_cast<uint8_t>(split_node->prefix[0])] =
+            split_node;
+        path.push_back({split_node, lcp});
+      }
+
+      if (lcp == bytes.size()) {
+        path.back().first->value = id;
+      } else {
+        auto leaf = make_node(bytes.substr(lcp));
+        leaf->value = id;
+        path.back().first->children[static_cast<uint8_t>(bytes[lcp])] = leaf;
+        path.push_back({leaf, bytes.size()});
+      }
+      previous = &bytes;
+    }
+  }
+
   int get_id(const std::string &token_bytes) {
     if (!root)
       return -1;
@@ -117,15 +162,7 @@ public:
 
       const std::string &prefix = child->prefix;
 
-      if (token_bytes.size() - i < prefix.size()) {
-        return -1;
-      }
-
-      try {
-        if (token_bytes.substr(i, prefix.size()) != prefix) {
-          return -1;
-        }
-      } catch (const std::exception &e) {
+      if (token_bytes.compare(i, prefix.size(), prefix) != 0) {
         return -1;
       }
 
@@ -137,66 +174,55 @@ public:
       return -1;
     }
 
-    if (current_node->value != -1) {
-      try {
-        current_node->last_accessed = current_time();
-        update_cache(current_node);
-      } catch (const std::exception &e) {
-        // TODO: Handle error when updating cache
-      }
-    }
-
     return current_node->value;
   }
 
-private:
-  std::deque<std::shared_ptr<CompressNode>> cache;
-  std::unordered_map<int, std::string> id_map;
-  std::unordered_map<std::string, int> byte_to_id;
-  size_t max_cache_size;
-
-  static double current_time() {
-    return std::chrono::duration<double>(
-               std::chrono::system_clock::now().time_since_epoch())
-        .count();
+  // Allocates a node in this tree's arena. Also used by RBTokenizer::load,
+  // which assembles the tree directly from its serialized form.
+  std::shared_ptr<CompressNode> make_node(const std::string &prefix) {
+    arena->emplace_back(prefix);
+    return std::shared_ptr<CompressNode>(arena, &arena->back());
   }
 
-  void update_cache(std::shared_ptr<CompressNode> node) {
-    if (!node)
-      return;
+  size_t node_count() const { return count_nodes(root.get()); }
 
-    auto it = std::find(cache.begin(), cache.end(), node);
-    if (it != cache.end()) {
-      cache.erase(it);
-    }
+  // Approximate heap footprint of the tree: nodes, spilled prefixes and the
+  // children hash tables.
+  size_t memory_bytes() const { return node_memory(root.get()); }
 
-    cache.push_front(node);
+private:
+  std::shared_ptr<std::deque<CompressNode>> arena;
 
-    if (cache.size() > max_cache_size) {
-      cache.pop_back();
+  // Every child link aliases the arena, so the arena keeps itself alive
+  // until those links are dropped.
+  void release() {
+    for (auto &node : *arena) {
+      node.children.clear();
     }
+    root.reset();
+    arena.reset();
   }
 
-  std::shared_ptr<CompressNode>
-  find_parent(std::shared_ptr<CompressNode> current,
-              std::shared_ptr<CompressNode> parent,
-              std::shared_ptr<CompressNode> target) {
-    if (!current || !target)
-      return nullptr;
-
-    for (const auto &[key, child] : current->children) {
-      if (!child)
-        continue;
+  static size_t count_nodes(const CompressNode *node) {
+    size_t count = 1;
+    for (const auto &[byte, child] : node->children) {
+      count += count_nodes(child.get());
+    }
+    return count;
+  }
 
-      if (child == target) {
-        return parent;
-      }
-      auto result = find_parent(child, current, target);
-      if (result != nullptr) {
-        return result;
-      }
+  static size_t node_memory(const CompressNode *node) {
+    using Entry = std::pair<const uint8_t, std::shared_ptr<CompressNode>>;
+    size_t bytes = sizeof(CompressNode);
+    if (node->prefix.capacity() > std::string().capacity()) {
+      bytes += node->prefix.capacity() + 1;
+    }
+    bytes += node->children.bucket_count() * sizeof(void *);
+    bytes += node->children.size() * (sizeof(Entry) + sizeof(void *));
+    for (const auto &[byte, child] : node->children) {
+      bytes += node_memory(child.get());
     }
-    return nullptr;
+    return bytes;
   }
 };
 
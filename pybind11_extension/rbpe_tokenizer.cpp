@@ -1,29 +1,142 @@
+#include "pipeline.h"
+#include "token_index.h"
 #include "tokenizer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <vector>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
 namespace py = pybind11;
 
+// Python-side driver for TokenizePipeline::map: pulls batch_size items at a
+// time from a Python iterator and keeps up to max_in_flight batches queued.
+class PipelineIterator {
+public:
+  PipelineIterator(TokenizePipeline &pipeline, py::iterable items,
+                   size_t batch_size)
+      : pipeline_(pipeline), source_(py::iter(items)),
+        batch_size_(std::max<size_t>(batch_size, 1)) {}
+
+  TokenizedBatch next() {
+    while (!exhausted_ && pending_.size() < pipeline_.max_in_flight()) {
+      std::vector<std::string> texts;
+      std::vector<float> dropout_probs;
+      while (texts.size() < batch_size_ && source_ != py::iterator::sentinel()) {
+        py::handle item = *source_;
+        if (py::isinstance<py::tuple>(item)) {
+          auto pair = item.cast<py::tuple>();
+          texts.push_back(pair[0].cast<std::string>());
+          dropout_probs.push_back(pair[1].cast<float>());
+        } else {
+          texts.push_back(item.cast<std::string>());
+          dropout_probs.push_back(0);
+        }
+        ++source_;
+      }
+      if (texts.empty()) {
+        exhausted_ = true;
+        break;
+      }
+      py::gil_scoped_release release;
+      pending_.push_back(
+          pipeline_.submit(std::move(texts), std::move(dropout_probs)));
+    }
+
+    if (pending_.empty())
+      throw py::stop_iteration();
+    std::shared_future<TokenizedBatch> future = std::move(pending_.front());
+    pending_.pop_front();
+    py::gil_scoped_release release;
+    return future.get();
+  }
+
+private:
+  TokenizePipeline &pipeline_;
+  py::iterator source_;
+  size_t batch_size_;
+  std::deque<std::shared_future<TokenizedBatch>> pending_;
+  bool exhausted_ = false;
+};
+
 PYBIND11_MODULE(rbpe_tokenizer, m) {
   m.doc() = "Type-safe RBPE Python bindings";
 
+  py::class_<CompactionReport>(m, "CompactionReport")
+      .def_readonly("vocab_before", &CompactionReport::vocab_before)
+      .def_readonly("vocab_after", &CompactionReport::vocab_after)
+      .def_readonly("nodes_before", &CompactionReport::nodes_before)
+      .def_readonly("nodes_after", &CompactionReport::nodes_after)
+      .def_readonly("tree_bytes_before", &CompactionReport::tree_bytes_before)
+      .def_readonly("tree_bytes_after", &CompactionReport::tree_bytes_after)
+      .def_readonly("encode_mb_per_s_before",
+                    &CompactionReport::encode_mb_per_s_before)
+      .def_readonly("encode_mb_per_s_after",
+                    &CompactionReport::encode_mb_per_s_after);
+
   py::class_<RBTokenizer>(m, "RBTokenizer")
       .def("save", &RBTokenizer::save, py::arg("path"))
       .def("load", &RBTokenizer::load, py::arg("path"))
-      .def(py::init<int, const std::vector<std::string> &>(),
+      .def("load_tiktoken", &RBTokenizer::load_tiktoken, py::arg("path"),
+           "Import a tiktoken base64 rank file")
+      .def("load_hf_merges", &RBTokenizer::load_hf_merges, py::arg("path"),
+           "Import a Hugging Face byte-level BPE merges.txt")
+      .def(py::init<int, const std::vector<std::string> &, bool>(),
            py::arg("max_depth") = 0,
-           py::arg("tech_terms") = std::vector<std::string>())
+           py::arg("tech_terms") = std::vector<std::string>(),
+           py::arg("pretokenize") = true)
+      .def_readonly("pretokenize", &RBTokenizer::pretokenize,
+                    "Whether text is pre-tokenized; set by load and the "
+                    "importers")
       .def("encode_with_dropout", &RBTokenizer::encode_with_dropout,
-           py::arg("text"), py::arg("dropout_prob") = 0.1)
+           py::arg("text"), py::arg("dropout_prob") = 0.1,
+           py::arg("seed") = 0)
       .def("chunk_with_overlap", &RBTokenizer::chunk_with_overlap,
            py::arg("text"), py::arg("chunk_size") = 512,
            py::arg("overlap") = 64)
       .def(
           "encode",
-          [](RBTokenizer &self, const std::string &text) {
+          [](RBTokenizer &self, const std::string &text,
+             std::optional<size_t> max_tokens) {
+            if (max_tokens)
+              return self.encode(text, *max_tokens);
             return self.encode(text);
           },
-          py::arg("text"), "Encode text to token IDs")
+          py::arg("text"), py::arg("max_tokens") = py::none(),
+          "Encode text to token IDs, keeping at most max_tokens of them",
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "encode_into",
+          [](RBTokenizer &self, std::string_view text, py::buffer out) {
+            py::buffer_info info = out.request(true);
+            if (info.ndim != 1 || info.itemsize != sizeof(int) ||
+                info.strides[0] != static_cast<py::ssize_t>(sizeof(int)) ||
+                (info.format != "i" && info.format != "l"))
+              throw py::value_error(
+                  "out must be a contiguous writable int32 buffer");
+            EncodeStatus status;
+            {
+              py::gil_scoped_release release;
+              status = self.encode_into(text, static_cast<int *>(info.ptr),
+                                        static_cast<size_t>(info.shape[0]));
+            }
+            return py::make_tuple(status.count, status.consumed,
+                                  status.complete);
+          },
+          py::arg("text"), py::arg("out"),
+          "Encode into a preallocated int32 buffer. Returns (count, consumed, "
+          "complete); consumed is a UTF-8 byte offset to resume from")
+      .def(
+          "count_tokens",
+          [](RBTokenizer &self, const std::string &text) {
+            return self.count_tokens(text);
+          },
+          py::arg("text"), "Number of tokens encode(text) would produce",
+          py::call_guard<py::gil_scoped_release>())
       .def(
           "decode",
           [](RBTokenizer &self, const std::vector<int> &ids) {
@@ -32,14 +145,20 @@ PYBIND11_MODULE(rbpe_tokenizer, m) {
           py::arg("ids"), "Decode token IDs to text")
       .def(
           "batch_encode",
+          [](RBTokenizer &self, const std::vector<std::string> &texts,
+             std::optional<size_t> max_tokens) {
+            return self.batch_encode(texts, max_tokens.value_or(SIZE_MAX));
+          },
+          py::arg("texts"), py::arg("max_tokens") = py::none(),
+          "Batch encode texts in parallel",
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "batch_count_tokens",
           [](RBTokenizer &self, const std::vector<std::string> &texts) {
-            std::vector<std::vector<int>> results;
-            for (const auto &text : texts) {
-              results.push_back(self.encode(text));
-            }
-            return results;
+            return self.batch_count_tokens(texts);
           },
-          py::arg("texts"), "Batch encode texts")
+          py::arg("texts"), "Token counts for texts, computed in parallel",
+          py::call_guard<py::gil_scoped_release>())
       .def(
           "train",
           [](RBTokenizer &self, const std::string &corpus, int vocab_size) {
@@ -49,5 +168,82 @@ PYBIND11_MODULE(rbpe_tokenizer, m) {
               throw py::value_error("Vocab size must be ≥256");
             self.train(corpus, vocab_size);
           },
-          py::arg("corpus"), py::arg("vocab_size"));
+          py::arg("corpus"), py::arg("vocab_size"))
+      .def(
+          "compact",
+          [](RBTokenizer &self, const std::string &sample, size_t min_count) {
+            return self.compact(sample, min_count);
+          },
+          py::arg("sample"), py::arg("min_count") = 1,
+          "Drop tokens used fewer than min_count times when encoding sample",
+          py::call_guard<py::gil_scoped_release>());
+
+  py::class_<TokenizedBatch>(m, "TokenizedBatch")
+      .def_readonly("tokens", &TokenizedBatch::tokens)
+      .def_readonly("texts", &TokenizedBatch::texts)
+      .def_readonly("source", &TokenizedBatch::source);
+
+  py::class_<std::shared_future<TokenizedBatch>>(m, "BatchFuture")
+      .def(
+          "result",
+          [](const std::shared_future<TokenizedBatch> &future) {
+            {
+              py::gil_scoped_release release;
+              future.wait();
+            }
+            return future.get();
+          },
+          "Wait for the batch and return it")
+      .def("done", [](const std::shared_future<TokenizedBatch> &future) {
+        return future.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+      });
+
+  py::class_<PipelineIterator>(m, "PipelineIterator")
+      .def("__iter__",
+           [](PipelineIterator &self) -> PipelineIterator & { return self; })
+      .def("__next__", &PipelineIterator::next);
+
+  py::class_<TokenizePipeline>(m, "TokenizePipeline")
+      .def(py::init<RBTokenizer &, size_t, int, int>(), py::arg("tokenizer"),
+           py::arg("max_in_flight") = 4, py::arg("chunk_size") = 0,
+           py::arg("overlap") = 64, py::keep_alive<1, 2>())
+      .def("submit", &TokenizePipeline::submit, py::arg("texts"),
+           py::arg("dropout_probs") = std::vector<float>(),
+           "Queue a batch for background tokenization; returns a BatchFuture",
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "map",
+          [](TokenizePipeline &self, py::iterable items, size_t batch_size) {
+            return PipelineIterator(self, items, batch_size);
+          },
+          py::arg("items"), py::arg("batch_size") = 64, py::keep_alive<0, 1>(),
+          "Yield TokenizedBatch objects in order for an iterable of texts or "
+          "(text, dropout_prob) pairs, tokenizing ahead in the background")
+      .def("wait_idle", &TokenizePipeline::wait_idle,
+           py::call_guard<py::gil_scoped_release>());
+
+  py::class_<TokenOverlapIndex>(m, "TokenOverlapIndex")
+      .def(py::init<>())
+      .def("__len__", &TokenOverlapIndex::size)
+      .def("add", &TokenOverlapIndex::add, py::arg("key"), py::arg("tokens"),
+           "Index a document's token ids under key")
+      .def("top_k", &TokenOverlapIndex::top_k, py::arg("tokens"),
+           py::arg("k"), py::arg("bm25") = false, py::arg("k1") = 1.2,
+           py::arg("b") = 0.75,
+           "Best (key, score) matches by shared distinct tokens, or by BM25",
+           py::call_guard<py::gil_scoped_release>())
+      .def("save", &TokenOverlapIndex::save, py::arg("path"))
+      .def("load", &TokenOverlapIndex::load, py::arg("path"));
+
+  m.def(
+      "pretokenize",
+      [](const std::string &text) {
+        std::vector<std::string> pieces;
+        PreTokenizer::for_each(text, [&](std::string_view piece) {
+          pieces.emplace_back(piece);
+        });
+        return pieces;
+      },
+      py::arg("text"), "Split text into the pieces used by train and encode");
 }
@@ -0,0 +1,206 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool where every worker owns a deque: it pops its own tasks
+// LIFO and steals from the other workers FIFO when it runs dry. Threads that
+// wait in parallel_for run queued tasks themselves, so nested parallel_for
+// calls from inside a task cannot deadlock the pool.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(size_t threads = default_threads()) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+      queues_.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this, i] { worker_loop(i); });
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  // Process-wide pool sized to the machine, created on first use.
+  static WorkStealingPool &shared() {
+    static WorkStealingPool pool;
+    return pool;
+  }
+
+  // RBPE_NUM_THREADS overrides the hardware thread count.
+  static size_t default_threads() {
+    if (const char *env = std::getenv("RBPE_NUM_THREADS")) {
+      long threads = std::strtol(env, nullptr, 10);
+      if (threads > 0)
+        return static_cast<size_t>(threads);
+    }
+    return std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  void submit(std::function<void()> task) {
+    size_t index = worker_index_ >= 0 && owner_ == this
+                       ? static_cast<size_t>(worker_index_)
+                       : next_queue_++ % queues_.size();
+    // Counted before it is queued, so a thread that takes the task at once
+    // cannot decrement pending_ below zero.
+    {
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+      pending_++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues_[index]->mtx);
+      queues_[index]->tasks.push_back(std::move(task));
+    }
+    wake_.notify_one();
+  }
+
+  // Runs fn(i) for every i in [0, count) and returns once all calls have
+  // finished. The first exception thrown by fn is rethrown here.
+  template <typename Fn> void parallel_for(size_t count, Fn &&fn) {
+    if (count == 0)
+      return;
+    if (count == 1) {
+      fn(size_t{0});
+      return;
+    }
+
+    struct Completion {
+      std::mutex mtx;
+      std::condition_variable done;
+      size_t remaining;
+      std::exception_ptr error;
+    };
+    auto completion = std::make_shared<Completion>();
+    completion->remaining = count;
+
+    for (size_t i = 0; i < count; ++i) {
+      submit([completion, &fn, i] {
+        std::exception_ptr error;
+        try {
+          fn(i);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(completion->mtx);
+        if (error && !completion->error)
+          completion->error = error;
+        if (--completion->remaining == 0)
+          completion->done.notify_all();
+      });
+    }
+
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(completion->mtx);
+        if (completion->remaining == 0)
+          break;
+      }
+      if (try_run_one(home_queue()))
+        continue;
+      std::unique_lock<std::mutex> lock(completion->mtx);
+      completion->done.wait_for(lock, std::chrono::milliseconds(1),
+                                [&] { return completion->remaining == 0; });
+    }
+
+    if (completion->error)
+      std::rethrow_exception(completion->error);
+  }
+
+private:
+  struct Queue {
+    std::mutex mtx;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex sleep_mtx_;
+  std::condition_variable wake_;
+  size_t pending_ = 0;
+  bool stop_ = false;
+  std::atomic<size_t> next_queue_{0};
+
+  static inline thread_local int worker_index_ = -1;
+  static inline thread_local WorkStealingPool *owner_ = nullptr;
+
+  size_t home_queue() const {
+    return worker_index_ >= 0 && owner_ == this
+               ? static_cast<size_t>(worker_index_)
+               : 0;
+  }
+
+  bool take(size_t home, std::function<void()> &task) {
+    {
+      Queue &own = *queues_[home];
+      std::lock_guard<std::mutex> lock(own.mtx);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t k = 1; k < queues_.size(); ++k) {
+      Queue &victim = *queues_[(home + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mtx);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool try_run_one(size_t home) {
+    std::function<void()> task;
+    if (!take(home, task))
+      return false;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+      pending_--;
+    }
+    task();
+    return true;
+  }
+
+  void worker_loop(size_t index) {
+    worker_index_ = static_cast<int>(index);
+    owner_ = this;
+    while (true) {
+      if (try_run_one(index))
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_mtx_);
+      wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+      if (stop_ && pending_ == 0)
+        return;
+    }
+  }
+};
+
+#endif // THREAD_POOL_H
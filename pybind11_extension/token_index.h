@@ -0,0 +1,242 @@
+#ifndef TOKEN_INDEX_H
+#define TOKEN_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Inverted index from token id to the documents containing it. Each posting
+// list is a byte stream of (doc delta, term frequency) varints in increasing
+// document order. Queries score term-at-a-time into a dense accumulator:
+// plain overlap counts the distinct query tokens a document shares, BM25
+// weights them by rarity and frequency instead. Queries and save share a
+// lock that add and load take exclusively, so top_k can run without the GIL
+// while another thread adds documents.
+class TokenOverlapIndex {
+public:
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return keys_.size();
+  }
+
+  // Adds a document under key and returns its document number.
+  uint32_t add(const std::string &key, const std::vector<int> &tokens) {
+    std::vector<int> sorted(tokens);
+    std::sort(sorted.begin(), sorted.end());
+
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    uint32_t doc = static_cast<uint32_t>(keys_.size());
+    keys_.push_back(key);
+    doc_lengths_.push_back(static_cast<uint32_t>(tokens.size()));
+    total_length_ += tokens.size();
+
+    for (size_t i = 0; i < sorted.size();) {
+      size_t j = i;
+      while (j < sorted.size() && sorted[j] == sorted[i])
+        j++;
+      Postings &list = postings_[sorted[i]];
+      put_varint(list.bytes, doc - list.last_doc);
+      put_varint(list.bytes, static_cast<uint32_t>(j - i));
+      list.last_doc = doc;
+      list.doc_count++;
+      i = j;
+    }
+    return doc;
+  }
+
+  // The k best documents for query as (key, score), best first. Documents
+  // sharing no token with the query are never returned; equal scores keep
+  // insertion order.
+  std::vector<std::pair<std::string, double>>
+  top_k(const std::vector<int> &query, size_t k, bool bm25 = false,
+        double k1 = 1.2, double b = 0.75) const {
+    std::vector<int> terms(query);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    std::vector<double> scores(keys_.size(), 0);
+    double docs = static_cast<double>(keys_.size());
+    double avg_length =
+        keys_.empty() ? 0 : static_cast<double>(total_length_) / docs;
+
+    for (int term : terms) {
+      auto it = postings_.find(term);
+      if (it == postings_.end())
+        continue;
+      const Postings &list = it->second;
+      double idf = std::log(1 + (docs - list.doc_count + 0.5) /
+                                    (list.doc_count + 0.5));
+
+      size_t pos = 0;
+      uint32_t doc = 0;
+      while (pos < list.bytes.size()) {
+        doc += get_varint(list.bytes, pos);
+        uint32_t tf = get_varint(list.bytes, pos);
+        if (!bm25) {
+          scores[doc] += 1;
+          continue;
+        }
+        double norm = avg_length > 0 ? doc_lengths_[doc] / avg_length : 0;
+        scores[doc] += idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * norm));
+      }
+    }
+
+    std::vector<uint32_t> hits;
+    for (uint32_t doc = 0; doc < scores.size(); ++doc) {
+      if (scores[doc] > 0)
+        hits.push_back(doc);
+    }
+    auto better = [&](uint32_t x, uint32_t y) {
+      return scores[x] > scores[y] || (scores[x] == scores[y] && x < y);
+    };
+    k = std::min(k, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + k, hits.end(), better);
+
+    std::vector<std::pair<std::string, double>> result;
+    result.reserve(k);
+    for (size_t i = 0; i < k; ++i)
+      result.push_back({keys_[hits[i]], scores[hits[i]]});
+    return result;
+  }
+
+  void save(const std::string &path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+      throw std::runtime_error("Failed to open file: " + path);
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    out.write(kMagic, sizeof(kMagic));
+
+    size_t doc_count = keys_.size();
+    out.write(reinterpret_cast<const char *>(&doc_count), sizeof(doc_count));
+    for (size_t doc = 0; doc < doc_count; ++doc) {
+      size_t len = keys_[doc].size();
+      out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+      out.write(keys_[doc].data(), len);
+      out.write(reinterpret_cast<const char *>(&doc_lengths_[doc]),
+                sizeof(uint32_t));
+    }
+
+    // Tokens in ascending order so equal indexes give equal files.
+    std::vector<int> tokens;
+    for (const auto &[token, list] : postings_)
+      tokens.push_back(token);
+    std::sort(tokens.begin(), tokens.end());
+
+    size_t token_count = tokens.size();
+    out.write(reinterpret_cast<const char *>(&token_count),
+              sizeof(token_count));
+    for (int token : tokens) {
+      const Postings &list = postings_.at(token);
+      size_t len = list.bytes.size();
+      out.write(reinterpret_cast<const char *>(&token), sizeof(token));
+      out.write(reinterpret_cast<const char *>(&list.doc_count),
+                sizeof(list.doc_count));
+      out.write(reinterpret_cast<const char *>(&list.last_doc),
+                sizeof(list.last_doc));
+      out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+      out.write(reinterpret_cast<const char *>(list.bytes.data()), len);
+    }
+  }
+
+  void load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw std::runtime_error("Failed to open file: " + path);
+    char magic[sizeof(kMagic)];
+    if (!in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), kMagic))
+      throw std::runtime_error(path + " is not a token index");
+
+    // Read into fresh containers so queries see the old index until the
+    // new one is complete, and a truncated file leaves it unchanged.
+    std::vector<std::string> keys;
+    std::vector<uint32_t> doc_lengths;
+    uint64_t total_length = 0;
+    std::unordered_map<int, Postings> postings;
+
+    size_t doc_count;
+    in.read(reinterpret_cast<char *>(&doc_count), sizeof(doc_count));
+    for (size_t doc = 0; doc < doc_count && in; ++doc) {
+      size_t len;
+      uint32_t doc_length;
+      in.read(reinterpret_cast<char *>(&len), sizeof(len));
+      std::string key(len, '\0');
+      in.read(&key[0], len);
+      in.read(reinterpret_cast<char *>(&doc_length), sizeof(doc_length));
+      keys.push_back(std::move(key));
+      doc_lengths.push_back(doc_length);
+      total_length += doc_length;
+    }
+
+    size_t token_count;
+    in.read(reinterpret_cast<char *>(&token_count), sizeof(token_count));
+    for (size_t i = 0; i < token_count && in; ++i) {
+      int token;
+      size_t len;
+      Postings list;
+      in.read(reinterpret_cast<char *>(&token), sizeof(token));
+      in.read(reinterpret_cast<char *>(&list.doc_count),
+              sizeof(list.doc_count));
+      in.read(reinterpret_cast<char *>(&list.last_doc),
+              sizeof(list.last_doc));
+      in.read(reinterpret_cast<char *>(&len), sizeof(len));
+      list.bytes.resize(len);
+      in.read(reinterpret_cast<char *>(list.bytes.data()), len);
+      postings[token] = std::move(list);
+    }
+    if (!in)
+      throw std::runtime_error("Truncated token index: " + path);
+
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    keys_ = std::move(keys);
+    doc_lengths_ = std::move(doc_lengths);
+    total_length_ = total_length;
+    postings_ = std::move(postings);
+  }
+
+private:
+  static constexpr char kMagic[8] = {'R', 'B', 'P', 'E', 'T', 'I', 'X', '1'};
+
+  struct Postings {
+    std::vector<uint8_t> bytes;
+    uint32_t doc_count = 0;
+    uint32_t last_doc = 0;
+  };
+
+  std::vector<std::string> keys_;
+  std::vector<uint32_t> doc_lengths_;
+  uint64_t total_length_ = 0;
+  std::unordered_map<int, Postings> postings_;
+  mutable std::shared_mutex mtx_;
+
+  static void put_varint(std::vector<uint8_t> &out, uint32_t value) {
+    while (value >= 0x80) {
+      out.push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+  }
+
+  static uint32_t get_varint(const std::vector<uint8_t> &in, size_t &pos) {
+    uint32_t value = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+      uint8_t byte = in[pos++];
+      value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    return value;
+  }
+};
+
+#endif // TOKEN_INDEX_H
@@ -0,0 +1,128 @@
+#include "token_shards.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const char kIndexMagic[8] = {'R', 'B', 'P', 'E', 'I', 'D', 'X', '1'};
+
+void check_width(uint32_t width) {
+  if (width != 2 && width != 4)
+    throw std::invalid_argument("token width must be 2 or 4 bytes");
+}
+
+// Little-endian store/load so shards are portable between hosts.
+void store(char *out, uint32_t value, uint32_t width) {
+  for (uint32_t b = 0; b < width; ++b)
+    out[b] = static_cast<char>((value >> (8 * b)) & 0xFF);
+}
+
+uint32_t load(const char *in, uint32_t width) {
+  uint32_t value = 0;
+  for (uint32_t b = 0; b < width; ++b)
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(in[b])) << (8 * b);
+  return value;
+}
+
+template <typename T> void write_le(std::ostream &out, T value) {
+  char bytes[sizeof(T)];
+  for (size_t b = 0; b < sizeof(T); ++b)
+    bytes[b] = static_cast<char>((static_cast<uint64_t>(value) >> (8 * b)) &
+                                 0xFF);
+  out.write(bytes, sizeof(T));
+}
+
+template <typename T> T read_le(std::istream &in) {
+  char bytes[sizeof(T)];
+  if (!in.read(bytes, sizeof(T)))
+    throw std::runtime_error("truncated token shard index");
+  uint64_t value = 0;
+  for (size_t b = 0; b < sizeof(T); ++b)
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[b])) << (8 * b);
+  return static_cast<T>(value);
+}
+
+} // namespace
+
+TokenShardWriter::TokenShardWriter(const std::string &prefix,
+                                   uint32_t token_width)
+    : prefix_(prefix), width_(token_width), offsets_{0} {
+  check_width(width_);
+  bin_.open(prefix_ + ".bin", std::ios::binary | std::ios::trunc);
+  if (!bin_)
+    throw std::runtime_error("cannot open " + prefix_ + ".bin for writing");
+}
+
+TokenShardWriter::~TokenShardWriter() {
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+void TokenShardWriter::add_document(const int *ids, size_t count) {
+  const uint64_t limit = width_ == 2 ? 0xFFFFu : 0xFFFFFFFFu;
+  buffer_.resize(count * width_);
+  for (size_t i = 0; i < count; ++i) {
+    if (ids[i] < 0 || static_cast<uint64_t>(ids[i]) > limit)
+      throw std::out_of_range("token id " + std::to_string(ids[i]) +
+                              " does not fit in " + std::to_string(width_) +
+                              " bytes");
+    store(&buffer_[i * width_], static_cast<uint32_t>(ids[i]), width_);
+  }
+  bin_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+  if (!bin_)
+    throw std::runtime_error("failed writing " + prefix_ + ".bin");
+  offsets_.push_back(offsets_.back() + count);
+}
+
+void TokenShardWriter::close() {
+  if (closed_)
+    return;
+  closed_ = true;
+  bin_.close();
+
+  std::ofstream idx(prefix_ + ".idx", std::ios::binary | std::ios::trunc);
+  if (!idx)
+    throw std::runtime_error("cannot open " + prefix_ + ".idx for writing");
+  idx.write(kIndexMagic, sizeof(kIndexMagic));
+  write_le<uint32_t>(idx, width_);
+  write_le<uint64_t>(idx, document_count());
+  for (uint64_t offset : offsets_)
+    write_le<uint64_t>(idx, offset);
+  if (!idx)
+    throw std::runtime_error("failed writing " + prefix_ + ".idx");
+}
+
+TokenShardReader::TokenShardReader(const std::string &prefix) {
+  std::ifstream idx(prefix + ".idx", std::ios::binary);
+  if (!idx)
+    throw std::runtime_error("cannot open " + prefix + ".idx");
+  char magic[sizeof(kIndexMagic)];
+  if (!idx.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, kIndexMagic, sizeof(magic)) != 0)
+    throw std::runtime_error(prefix + ".idx is not a token shard index");
+  width_ = read_le<uint32_t>(idx);
+  check_width(width_);
+  uint64_t documents = read_le<uint64_t>(idx);
+  offsets_.resize(documents + 1);
+  for (auto &offset : offsets_)
+    offset = read_le<uint64_t>(idx);
+
+  bin_.open(prefix + ".bin", std::ios::binary);
+  if (!bin_)
+    throw std::runtime_error("cannot open " + prefix + ".bin");
+}
+
+void TokenShardReader::read_document(size_t index, std::vector<int> &ids) {
+  if (index >= document_count())
+    throw std::out_of_range("document index out of range");
+  uint64_t count = offsets_[index + 1] - offsets_[index];
+  buffer_.resize(count * width_);
+  bin_.seekg(static_cast<std::streamoff>(offsets_[index] * width_));
+  if (!bin_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size())))
+    throw std::runtime_error("truncated token shard");
+  ids.resize(count);
+  for (uint64_t i = 0; i < count; ++i)
+    ids[i] = static_cast<int>(load(&buffer_[i * width_], width_));
+}
@@ -0,0 +1,61 @@
+#ifndef TOKEN_SHARDS_H
+#define TOKEN_SHARDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Packed token shards: <prefix>.bin holds the ids of every document back to
+// back as little-endian uint16 or uint32, and <prefix>.idx holds
+//   "RBPEIDX1" | uint32 token width | uint64 document count |
+//   uint64 token offset of each document, plus the total
+// so a training job can mmap the .bin file and slice documents directly.
+class TokenShardWriter {
+public:
+  TokenShardWriter(const std::string &prefix, uint32_t token_width);
+  ~TokenShardWriter();
+
+  TokenShardWriter(const TokenShardWriter &) = delete;
+  TokenShardWriter &operator=(const TokenShardWriter &) = delete;
+
+  // Throws std::out_of_range if an id does not fit in the token width.
+  void add_document(const int *ids, size_t count);
+  void add_document(const std::vector<int> &ids) {
+    add_document(ids.data(), ids.size());
+  }
+
+  // Writes the index. Called by the destructor if not called explicitly.
+  void close();
+
+  size_t document_count() const { return offsets_.size() - 1; }
+  uint64_t token_count() const { return offsets_.back(); }
+
+private:
+  std::string prefix_;
+  uint32_t width_;
+  std::ofstream bin_;
+  std::vector<uint64_t> offsets_;
+  std::vector<char> buffer_;
+  bool closed_ = false;
+};
+
+class TokenShardReader {
+public:
+  explicit TokenShardReader(const std::string &prefix);
+
+  size_t document_count() const { return offsets_.size() - 1; }
+  uint32_t token_width() const { return width_; }
+  uint64_t token_count() const { return offsets_.back(); }
+
+  void read_document(size_t index, std::vector<int> &ids);
+
+private:
+  uint32_t width_ = 0;
+  std::ifstream bin_;
+  std::vector<uint64_t> offsets_;
+  std::vector<char> buffer_;
+};
+
+#endif // TOKEN_SHARDS_H
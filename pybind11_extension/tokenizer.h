@@ -3,9 +3,13 @@
 
 #include "indexed_list.h"
 #include "pairmultiset.h"
+#include "pretokenizer.h"
 #include "rbpe.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <functional>
@@ -14,35 +18,76 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+// Sizes and throughput before and after RBTokenizer::compact. Throughput is
+// measured by encoding the compaction sample and is 0 for an empty sample.
+struct CompactionReport {
+  size_t vocab_before = 0;
+  size_t vocab_after = 0;
+  size_t nodes_before = 0;
+  size_t nodes_after = 0;
+  size_t tree_bytes_before = 0;
+  size_t tree_bytes_after = 0;
+  double encode_mb_per_s_before = 0;
+  double encode_mb_per_s_after = 0;
+};
+
+// Outcome of RBTokenizer::encode_into. When complete is false the output
+// buffer filled up: count ids were written for the first consumed bytes and
+// encoding resumes from text.substr(consumed). A result with count == 0 and
+// complete == false means the buffer cannot hold the next piece.
+struct EncodeStatus {
+  size_t count = 0;
+  size_t consumed = 0;
+  bool complete = true;
+};
+
 class RBTokenizer {
 public:
   std::unordered_map<int, std::string> vocab;
   std::unordered_map<std::pair<int, int>, int, pair_hash> merges;
   std::unordered_set<std::string> tech_terms;
-  std::mutex mtx;
+  // Held shared by encode, decode and save and exclusively by train,
+  // compact and the loaders, so the model never changes under a reader.
+  std::shared_mutex mtx;
   int max_depth;
+  // Split text with PreTokenizer so tokens never cross word, number,
+  // whitespace or code point boundaries. Saved with the model; load
+  // replaces the value given to the constructor and the importers set it.
+  bool pretokenize;
+  // Inputs of at least this many bytes are split at safe boundaries and
+  // encoded in segments of roughly parallel_segment_bytes on the shared pool.
+  size_t parallel_min_bytes = 4 << 20;
+  size_t parallel_segment_bytes = 1 << 20;
   std::unique_ptr<RadixBalancedTree> rbt;
 
   RBTokenizer(int max_depth = 0,
-              const std::vector<std::string> &tech_terms = {})
-      : max_depth(max_depth), rbt(new RadixBalancedTree()) {
+              const std::vector<std::string> &tech_terms = {},
+              bool pretokenize = true)
+      : max_depth(max_depth), pretokenize(pretokenize),
+        rbt(new RadixBalancedTree()) {
     for (int i = 0; i < 256; ++i) {
       vocab[i] = std::string(1, static_cast<char>(i));
     }
   }
 
   std::string decode(const std::vector<int> &ids) {
+    ModelLock lock(*this, ModelLock::kShared);
     std::string result;
 
     for (int id : ids) {
-      if (vocab.find(id) != vocab.end()) {
-        result += vocab[id];
+      auto it = vocab.find(id);
+      if (it != vocab.end()) {
+        result += it->second;
       } else {
         result += static_cast<char>(id);
       }
@@ -50,66 +95,152 @@ public:
     return result;
   }
 
-  std::vector<int> encode(const std::string &text) {
-    std::vector<int> byte_stream(text.begin(), text.end());
-    std::vector<int> ids;
-    size_t pos = 0;
-
-    CompressNode *current_node = rbt->root.get();
-    int longest_match_id = -1;
-    size_t longest_match_pos = 0;
-
-    while (pos < byte_stream.size()) {
-      uint8_t current_byte = byte_stream[pos];
+  std::vector<int> encode(std::string_view text) {
+    ModelLock lock(*this, ModelLock::kShared);
+    if (use_parallel(text)) {
+      return encode_parallel(text);
+    }
 
-      if (current_node->children.count(current_byte)) {
-        auto child = current_node->children[current_byte];
-        size_t prefix_len = child->prefix.size();
+    std::vector<int> ids;
+    encode_each(text, [&](int id) {
+      ids.push_back(id);
+      return true;
+    });
+    return ids;
+  }
 
-        if (text.compare(pos, prefix_len, child->prefix) == 0) {
-          current_node = child.get();
-          pos += prefix_len;
+  // Writes the ids of text into out[0, capacity) without allocating. With
+  // pre-tokenization the output is cut at a piece boundary so that resuming
+  // from status.consumed reproduces the ids of a single encode call.
+  EncodeStatus encode_into(std::string_view text, int *out, size_t capacity) {
+    ModelLock lock(*this, ModelLock::kShared);
+    EncodeStatus status;
+    size_t pos = 0;
 
-          if (current_node->value != -1) {
-            longest_match_id = current_node->value;
-            longest_match_pos = pos;
-          }
-          continue;
+    while (pos < text.size()) {
+      size_t end = pretokenize ? PreTokenizer::next_piece(text, pos)
+                               : text.size();
+      size_t written = status.count;
+      bool fits = encode_piece(text.substr(pos, end - pos), [&](int id) {
+        if (written == capacity)
+          return false;
+        out[written++] = id;
+        return true;
+      });
+
+      if (!fits) {
+        status.complete = false;
+        if (!pretokenize) {
+          status.consumed = pos;
+          for (size_t i = status.count; i < written; ++i)
+            status.consumed += token_length(out[i]);
+          status.count = written;
         }
+        return status;
       }
+      status.count = written;
+      status.consumed = end;
+      pos = end;
+    }
+    return status;
+  }
 
-      if (longest_match_id != -1) {
-        ids.push_back(longest_match_id);
-        pos = longest_match_pos;
-      } else {
-        ids.push_back(static_cast<int>(byte_stream[pos]));
-        pos++;
-      }
+  EncodeStatus encode_into(const uint8_t *data, size_t size, int *out,
+                           size_t capacity) {
+    return encode_into(
+        std::string_view(reinterpret_cast<const char *>(data), size), out,
+        capacity);
+  }
 
-      current_node = rbt->root.get();
-      longest_match_id = -1;
-      longest_match_pos = pos;
-    }
+  // Encodes into a caller-owned vector, reusing its capacity. A per-thread
+  // vector makes steady-state encoding allocation-free.
+  size_t encode_into(std::string_view text, std::vector<int> &out) {
+    ModelLock lock(*this, ModelLock::kShared);
+    out.clear();
+    encode_each(text, [&](int id) {
+      out.push_back(id);
+      return true;
+    });
+    return out.size();
+  }
 
-    if (longest_match_id != -1) {
-      ids.push_back(longest_match_id);
+  // Returns the first max_tokens tokens of encode(text) without encoding
+  // the rest of the input.
+  std::vector<int> encode(std::string_view text, size_t max_tokens) {
+    ModelLock lock(*this, ModelLock::kShared);
+    std::vector<int> ids;
+    if (max_tokens == 0)
+      return ids;
+    ids.reserve(std::min(max_tokens, text.size()));
+    encode_each(text, [&](int id) {
+      ids.push_back(id);
+      return ids.size() < max_tokens;
+    });
+    return ids;
+  }
+
+  // Number of tokens encode(text) would produce, without materializing them.
+  size_t count_tokens(std::string_view text) {
+    ModelLock lock(*this, ModelLock::kShared);
+    if (!use_parallel(text)) {
+      size_t count = 0;
+      encode_each(text, [&](int) {
+        count++;
+        return true;
+      });
+      return count;
     }
 
-    return ids;
+    std::vector<size_t> bounds = safe_segments(text);
+    std::vector<size_t> counts(bounds.size() - 1, 0);
+    WorkStealingPool::shared().parallel_for(counts.size(), [&](size_t i) {
+      encode_each(text.substr(bounds[i], bounds[i + 1] - bounds[i]),
+                  [&](int) {
+                    counts[i]++;
+                    return true;
+                  });
+    });
+    size_t total = 0;
+    for (size_t count : counts)
+      total += count;
+    return total;
+  }
+
+  std::vector<std::vector<int>>
+  batch_encode(const std::vector<std::string> &texts,
+               size_t max_tokens = SIZE_MAX) {
+    ModelLock lock(*this, ModelLock::kShared);
+    std::vector<std::vector<int>> results(texts.size());
+    parallel_for_locked(texts.size(), [&](size_t i) {
+      results[i] = max_tokens == SIZE_MAX ? encode(texts[i])
+                                          : encode(texts[i], max_tokens);
+    });
+    return results;
+  }
+
+  std::vector<size_t> batch_count_tokens(const std::vector<std::string> &texts) {
+    ModelLock lock(*this, ModelLock::kShared);
+    std::vector<size_t> counts(texts.size());
+    parallel_for_locked(
+        texts.size(), [&](size_t i) { counts[i] = count_tokens(texts[i]); });
+    return counts;
   }
 
   void train(const std::string &text, int vocab_size,
              int merge_batch_size = 32) {
-    std::vector<uint8_t> text_bytes(text.begin(), text.end());
-    IndexedList list(text_bytes);
+    ModelLock lock(*this, ModelLock::kExclusive);
+    require_byte_ids("train");
+    std::vector<std::string_view> pieces =
+        pretokenize ? PreTokenizer::split(text)
+                    : std::vector<std::string_view>{text};
+    IndexedList list(pieces);
+    // PairMultiset orders pairs totally, so the merge sequence depends only
+    // on the counts and not on the order they were added in.
     PairMultiset stats;
-    IndexedList::Node *curr = list.head;
-
-    while (curr && curr->next) {
-      stats.add({curr->val, curr->next->val});
-      curr = curr->next;
+    for (const auto &[pair, count] : count_piece_pairs(pieces)) {
+      stats.add(pair, count);
     }
-    int total_merges = vocab_size - 256 - merges.size();
+    int total_merges = vocab_size - next_token_id();
 
     for (int i = 0; i < total_merges; i++) {
       auto [pair, count] = stats.max();
@@ -117,15 +248,12 @@ public:
         break;
 
       // Creating new tokens
-      int new_id = 256 + merges.size();
+      int new_id = next_token_id();
       std::string merged_bytes = vocab[pair.first] + vocab[pair.second];
 
-      {
-        std::lock_guard<std::mutex> lock(mtx);
-        merges[pair] = new_id;
-        vocab[new_id] = merged_bytes;
-        rbt->insert(merged_bytes, new_id);
-      }
+      merges[pair] = new_id;
+      vocab[new_id] = merged_bytes;
+      rbt->insert(merged_bytes, new_id);
       apply_merge(list, pair, new_id, stats);
     }
   }
@@ -140,14 +268,14 @@ public:
         continue;
       }
 
-      if (node->prev) {
+      if (node->prev && !node->boundary) {
         stats.remove({node->prev->val, node->val});
       }
 
       if (node->next) {
         stats.remove({node->val, node->next->val});
 
-        if (node->next->next) {
+        if (node->next->next && !node->next->next->boundary) {
           stats.remove({node->next->val, node->next->next->val});
         }
       }
@@ -162,62 +290,51 @@ public:
         next_next->prev = node;
       }
 
-      delete to_delete;
+      list.retire(to_delete);
 
       list.update_index(node);
 
-      if (node->prev) {
+      if (node->prev && !node->boundary) {
         stats.add({node->prev->val, new_id});
       }
 
-      if (node->next) {
+      if (node->next && !node->next->boundary) {
         stats.add({new_id, node->next->val});
       }
     }
   }
 
+  // BPE-dropout. The same text, probability and seed always give the same
+  // ids: draws come from a local mt19937_64, whose output the standard fixes.
+  // Like encode, tokens never cross a pre-tokenizer piece.
   std::vector<int> encode_with_dropout(const std::string &text,
-                                       float dropout_prob = 0.1) {
-    std::vector<unsigned char> chars(text.begin(), text.end());
+                                       float dropout_prob = 0.1,
+                                       uint64_t seed = 0) {
+    ModelLock lock(*this, ModelLock::kShared);
+    std::mt19937_64 rng(seed);
     std::vector<int> ids;
 
+    if (!pretokenize) {
+      dropout_piece(text, dropout_prob, rng, ids);
+      return ids;
+    }
+    std::string_view view = text;
     size_t pos = 0;
-    while (pos < chars.size()) {
-      int best_token_id = -1;
-      size_t best_length = 0;
-
-      for (size_t len = 1;
-           len <= std::min(static_cast<size_t>(max_depth), chars.size() - pos);
-           len++) {
-        std::string substr(chars.begin() + pos, chars.begin() + pos + len);
-        int token_id = rbt->get_id(substr);
-
-        if (token_id != -1) {
-          bool should_apply =
-              (len == 1) || ((double)rand() / RAND_MAX) > dropout_prob;
-
-          if (should_apply && len > best_length) {
-            best_token_id = token_id;
-            best_length = len;
-          }
-        }
-      }
-
-      if (best_length > 0) {
-        ids.push_back(best_token_id);
-        pos += best_length;
-      } else {
-        ids.push_back(chars[pos]);
-        pos++;
-      }
+    while (pos < view.size()) {
+      size_t end = PreTokenizer::next_piece(view, pos);
+      dropout_piece(view.substr(pos, end - pos), dropout_prob, rng, ids);
+      pos = end;
     }
-
     return ids;
   }
 
   std::vector<std::vector<int>> chunk_with_overlap(const std::string &text,
                                                    int chunk_size = 512,
                                                    int overlap = 64) {
+    if (chunk_size <= 0 || overlap < 0 || overlap >= chunk_size)
+      throw std::invalid_argument(
+          "chunk_with_overlap needs 0 <= overlap < chunk_size");
+    ModelLock lock(*this, ModelLock::kShared);
     std::vector<int> tokens = encode(text);
     std::vector<std::vector<int>> chunks;
 
@@ -240,22 +357,109 @@ public:
     return chunks;
   }
 
+  // Drops merged tokens the encoder emits fewer than min_count times on
+  // sample, renumbers the survivors densely from 256 in their original
+  // order and rebuilds the radix tree. Byte tokens are always kept. Merges
+  // that reference a dropped token are removed.
+  CompactionReport compact(std::string_view sample, size_t min_count = 1) {
+    ModelLock lock(*this, ModelLock::kExclusive);
+    require_byte_ids("compact");
+    CompactionReport report;
+    report.vocab_before = vocab.size();
+    report.nodes_before = rbt->node_count();
+    report.tree_bytes_before = rbt->memory_bytes();
+
+    // Throughput is timed on a plain encode so both sides of the report
+    // measure the same work; usage is counted in a separate pass.
+    report.encode_mb_per_s_before =
+        timed_encode(sample, [](int) { return true; });
+
+    int max_id = 0;
+    for (const auto &[id, bytes] : vocab)
+      max_id = std::max(max_id, id);
+    std::vector<size_t> usage(static_cast<size_t>(max_id) + 1, 0);
+    encode_each(sample, [&](int id) {
+      if (id >= 0 && static_cast<size_t>(id) < usage.size())
+        usage[id]++;
+      return true;
+    });
+
+    std::vector<int> kept;
+    for (const auto &[id, bytes] : vocab) {
+      if (id >= 256 && usage[static_cast<size_t>(id)] >= min_count)
+        kept.push_back(id);
+    }
+    std::sort(kept.begin(), kept.end());
+
+    std::unordered_map<int, int> remap;
+    for (int i = 0; i < 256; ++i)
+      remap[i] = i;
+    for (size_t i = 0; i < kept.size(); ++i)
+      remap[kept[i]] = static_cast<int>(256 + i);
+
+    std::unordered_map<int, std::string> new_vocab;
+    std::vector<std::pair<std::string, int>> tokens;
+    for (int i = 0; i < 256; ++i)
+      new_vocab[i] = vocab[i];
+    for (int old_id : kept) {
+      int new_id = remap[old_id];
+      new_vocab[new_id] = vocab[old_id];
+      tokens.push_back({vocab[old_id], new_id});
+    }
+    std::sort(tokens.begin(), tokens.end());
+    std::unique_ptr<RadixBalancedTree> new_rbt(new RadixBalancedTree());
+    new_rbt->build(tokens);
+
+    std::unordered_map<std::pair<int, int>, int, pair_hash> new_merges;
+    for (const auto &[pair, id] : merges) {
+      auto first = remap.find(pair.first);
+      auto second = remap.find(pair.second);
+      auto merged = remap.find(id);
+      if (first != remap.end() && second != remap.end() &&
+          merged != remap.end())
+        new_merges[{first->second, second->second}] = merged->second;
+    }
+
+    vocab = std::move(new_vocab);
+    merges = std::move(new_merges);
+    rbt = std::move(new_rbt);
+
+    report.vocab_after = vocab.size();
+    report.nodes_after = rbt->node_count();
+    report.tree_bytes_after = rbt->memory_bytes();
+    report.encode_mb_per_s_after =
+        timed_encode(sample, [](int) { return true; });
+    return report;
+  }
+
   void save(const std::string &path) {
-    std::lock_guard<std::mutex> lock(mtx);
+    ModelLock lock(*this, ModelLock::kShared);
     std::ofstream out(path, std::ios::binary);
-
-    size_t vocab_size = vocab.size();
+    out.write(kModelMagic, sizeof(kModelMagic));
+    uint8_t flags = pretokenize ? kPretokenizeFlag : 0;
+    out.write(reinterpret_cast<const char *>(&flags), sizeof(flags));
+
+    // Entries are written in sorted order so equal models give equal files.
+    std::vector<std::pair<int, std::string>> sorted_vocab(vocab.begin(),
+                                                          vocab.end());
+    std::sort(sorted_vocab.begin(), sorted_vocab.end());
+    size_t vocab_size = sorted_vocab.size();
     out.write(reinterpret_cast<char *>(&vocab_size), sizeof(vocab_size));
-    for (const auto &[id, bytes] : vocab) {
+    for (const auto &[id, bytes] : sorted_vocab) {
       out.write(reinterpret_cast<const char *>(&id), sizeof(id));
       size_t len = bytes.size();
       out.write(reinterpret_cast<const char *>(&len), sizeof(len));
       out.write(bytes.data(), len);
     }
 
-    size_t merges_size = merges.size();
-    out.write(reinterpret_cast<char *>(&merges_size), sizeof(merges_size));
+    std::vector<std::pair<int, std::pair<int, int>>> sorted_merges;
     for (const auto &[pair, id] : merges) {
+      sorted_merges.push_back({id, pair});
+    }
+    std::sort(sorted_merges.begin(), sorted_merges.end());
+    size_t merges_size = sorted_merges.size();
+    out.write(reinterpret_cast<char *>(&merges_size), sizeof(merges_size));
+    for (const auto &[id, pair] : sorted_merges) {
       out.write(reinterpret_cast<const char *>(&pair.first),
                 sizeof(pair.first));
       out.write(reinterpret_cast<const char *>(&pair.second),
@@ -266,7 +470,7 @@ public:
   }
 
   void load(const std::string &path) {
-    std::lock_guard<std::mutex> lock(mtx);
+    ModelLock lock(*this, ModelLock::kExclusive);
     std::ifstream in(path, std::ios::binary);
 
     // Clear existing state
@@ -274,6 +478,20 @@ public:
     merges.clear();
     rbt.reset(new RadixBalancedTree());
 
+    // Files written before the header existed start with the vocab size and
+    // were always encoded without pre-tokenization.
+    char magic[sizeof(kModelMagic)] = {};
+    in.read(magic, sizeof(magic));
+    if (in && std::equal(magic, magic + sizeof(magic), kModelMagic)) {
+      uint8_t flags = 0;
+      in.read(reinterpret_cast<char *>(&flags), sizeof(flags));
+      pretokenize = flags & kPretokenizeFlag;
+    } else {
+      in.clear();
+      in.seekg(0);
+      pretokenize = false;
+    }
+
     // Load vocab
     size_t vocab_size;
     in.read(reinterpret_cast<char *>(&vocab_size), sizeof(vocab_size));
@@ -302,7 +520,434 @@ public:
     rebuild_tree(in, rbt->root);
   }
 
+  // Imports a tiktoken rank file: one "<base64 token> <rank>" per line. The
+  // ranks become ids and every token, single bytes included, goes into the
+  // radix tree, so the file must cover all 256 bytes. Sets pretokenize, as
+  // tiktoken vocabularies are trained on split text, but PreTokenizer is the
+  // GPT-2 pattern, so ids can differ from tiktoken's own encoder. Byte
+  // tokens keep their ranks rather than ids 0-255, so the imported model
+  // cannot be trained further or compacted.
+  void load_tiktoken(const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open())
+      throw std::runtime_error("Failed to open file: " + path);
+
+    std::unordered_map<int, std::string> new_vocab;
+    std::vector<std::pair<std::string, int>> tokens;
+    std::vector<bool> byte_seen(256, false);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty())
+        continue;
+      size_t space = line.find(' ');
+      if (space == std::string::npos)
+        throw std::runtime_error("Malformed tiktoken line: " + line);
+      std::string bytes = decode_base64(line.substr(0, space));
+      int rank = std::stoi(line.substr(space + 1));
+      if (bytes.size() == 1)
+        byte_seen[static_cast<uint8_t>(bytes[0])] = true;
+      new_vocab[rank] = bytes;
+      tokens.push_back({bytes, rank});
+    }
+    if (std::find(byte_seen.begin(), byte_seen.end(), false) !=
+        byte_seen.end())
+      throw std::runtime_error("tiktoken file does not cover all 256 bytes");
+
+    std::sort(tokens.begin(), tokens.end());
+    ModelLock lock(*this, ModelLock::kExclusive);
+    vocab = std::move(new_vocab);
+    merges.clear();
+    pretokenize = true;
+    rbt.reset(new RadixBalancedTree());
+    rbt->build(tokens);
+  }
+
+  // Imports a Hugging Face byte-level BPE merges.txt ("a b" per line in the
+  // GPT-2 byte-to-unicode alphabet). Byte tokens keep ids 0-255 and merge i
+  // becomes id 256 + i, exactly as if train had produced it. Sets
+  // pretokenize, since those merges were learned on GPT-2 pieces.
+  void load_hf_merges(const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open())
+      throw std::runtime_error("Failed to open file: " + path);
+
+    std::unordered_map<int, std::string> new_vocab;
+    std::unordered_map<std::string, int> ids;
+    for (int i = 0; i < 256; ++i) {
+      new_vocab[i] = std::string(1, static_cast<char>(i));
+      ids[new_vocab[i]] = i;
+    }
+
+    std::unordered_map<std::pair<int, int>, int, pair_hash> new_merges;
+    std::vector<std::pair<std::string, int>> tokens;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty() || line.rfind("#version", 0) == 0)
+        continue;
+      size_t space = line.find(' ');
+      if (space == std::string::npos)
+        throw std::runtime_error("Malformed merges line: " + line);
+      auto first = ids.find(gpt2_unicode_to_bytes(line.substr(0, space)));
+      auto second = ids.find(gpt2_unicode_to_bytes(line.substr(space + 1)));
+      if (first == ids.end() || second == ids.end())
+        throw std::runtime_error("Merge of unknown tokens: " + line);
+
+      int new_id = static_cast<int>(new_vocab.size());
+      std::string merged = new_vocab[first->second] + new_vocab[second->second];
+      new_merges[{first->second, second->second}] = new_id;
+      new_vocab[new_id] = merged;
+      ids[merged] = new_id;
+      tokens.push_back({merged, new_id});
+    }
+
+    std::sort(tokens.begin(), tokens.end());
+    ModelLock lock(*this, ModelLock::kExclusive);
+    vocab = std::move(new_vocab);
+    merges = std::move(new_merges);
+    pretokenize = true;
+    rbt.reset(new RadixBalancedTree());
+    rbt->build(tokens);
+  }
+
 private:
+  // Scoped hold on mtx. A pool thread waiting in parallel_for runs other
+  // queued tasks, which may encode with the tokenizer that thread already
+  // holds, so a thread never locks mtx twice. kCovered marks a task that
+  // runs under a lock its caller holds on another thread. A waiting writer
+  // holds writer_gate, which keeps new readers out so it cannot starve.
+  class ModelLock {
+  public:
+    enum Mode { kShared, kExclusive, kCovered };
+
+    ModelLock(RBTokenizer &tokenizer, Mode mode)
+        : tokenizer_(tokenizer), outer_(holder()), mode_(mode) {
+      if (outer_ == &tokenizer_)
+        return;
+      if (mode_ == kShared) {
+        { std::lock_guard<std::mutex> gate(tokenizer_.writer_gate); }
+        tokenizer_.mtx.lock_shared();
+      } else if (mode_ == kExclusive) {
+        std::lock_guard<std::mutex> gate(tokenizer_.writer_gate);
+        tokenizer_.mtx.lock();
+      }
+      holder() = &tokenizer_;
+    }
+
+    ~ModelLock() {
+      if (outer_ == &tokenizer_)
+        return;
+      holder() = outer_;
+      if (mode_ == kShared)
+        tokenizer_.mtx.unlock_shared();
+      else if (mode_ == kExclusive)
+        tokenizer_.mtx.unlock();
+    }
+
+    ModelLock(const ModelLock &) = delete;
+    ModelLock &operator=(const ModelLock &) = delete;
+
+  private:
+    RBTokenizer &tokenizer_;
+    RBTokenizer *outer_;
+    Mode mode_;
+
+    static RBTokenizer *&holder() {
+      static thread_local RBTokenizer *current = nullptr;
+      return current;
+    }
+  };
+
+  std::mutex writer_gate;
+
+  // parallel_for whose tasks call public methods under the caller's lock.
+  template <typename Fn> void parallel_for_locked(size_t count, Fn &&fn) {
+    WorkStealingPool::shared().parallel_for(count, [&](size_t i) {
+      ModelLock covered(*this, ModelLock::kCovered);
+      fn(i);
+    });
+  }
+
+  static constexpr char kModelMagic[8] = {'R', 'B', 'P', 'E', 'M', 'D', 'L', '1'};
+  static constexpr uint8_t kPretokenizeFlag = 1;
+
+  static std::string decode_base64(const std::string &encoded) {
+    std::string out;
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : encoded) {
+      int value;
+      if (c >= 'A' && c <= 'Z')
+        value = c - 'A';
+      else if (c >= 'a' && c <= 'z')
+        value = c - 'a' + 26;
+      else if (c >= '0' && c <= '9')
+        value = c - '0' + 52;
+      else if (c == '+')
+        value = 62;
+      else if (c == '/')
+        value = 63;
+      else if (c == '=')
+        break;
+      else
+        throw std::runtime_error("Invalid base64 token: " + encoded);
+      buffer = (buffer << 6) | static_cast<uint32_t>(value);
+      bits += 6;
+      if (bits >= 8) {
+        bits -= 8;
+        out += static_cast<char>((buffer >> bits) & 0xFF);
+      }
+    }
+    return out;
+  }
+
+  // Inverts GPT-2's bytes_to_unicode: printable Latin-1 bytes map to
+  // themselves and the other 68 bytes to U+0100 onwards, in byte order.
+  static std::string gpt2_unicode_to_bytes(const std::string &token) {
+    static const std::unordered_map<uint32_t, uint8_t> table = [] {
+      std::unordered_map<uint32_t, uint8_t> map;
+      uint32_t next = 256;
+      for (int b = 0; b < 256; ++b) {
+        bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) ||
+                         (b >= 0xAE && b <= 0xFF);
+        map[printable ? static_cast<uint32_t>(b) : next++] =
+            static_cast<uint8_t>(b);
+      }
+      return map;
+    }();
+
+    std::string out;
+    for (size_t i = 0; i < token.size();) {
+      uint8_t lead = static_cast<uint8_t>(token[i]);
+      size_t len = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+      uint32_t cp = len == 1 ? lead : lead & (0x7F >> len);
+      for (size_t k = 1; k < len && i + k < token.size(); ++k)
+        cp = (cp << 6) | (static_cast<uint8_t>(token[i + k]) & 0x3F);
+      auto it = table.find(cp);
+      if (it == table.end())
+        throw std::runtime_error("Not a byte-level BPE token: " + token);
+      out += static_cast<char>(it->second);
+      i += len;
+    }
+    return out;
+  }
+
+  size_t token_length(int id) const {
+    auto it = vocab.find(id);
+    return it != vocab.end() ? it->second.size() : 1;
+  }
+
+  // Uniform double in [0, 1) from the top 53 bits of one draw.
+  static double unit_draw(std::mt19937_64 &rng) {
+    return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Adjacent pair counts within each piece. Large inputs are counted in
+  // parallel slices; summing is order independent, so the result is the
+  // same as a serial count.
+  std::unordered_map<std::pair<int, int>, int, pair_hash>
+  count_piece_pairs(const std::vector<std::string_view> &pieces) {
+    const size_t kPiecesPerSlice = 1 << 16;
+    size_t slices = (pieces.size() + kPiecesPerSlice - 1) / kPiecesPerSlice;
+    std::vector<std::unordered_map<std::pair<int, int>, int, pair_hash>>
+        partial(slices);
+
+    WorkStealingPool::shared().parallel_for(slices, [&](size_t s) {
+      size_t end = std::min(pieces.size(), (s + 1) * kPiecesPerSlice);
+      for (size_t p = s * kPiecesPerSlice; p < end; ++p) {
+        const std::string_view piece = pieces[p];
+        for (size_t i = 0; i + 1 < piece.size(); ++i) {
+          partial[s][{static_cast<uint8_t>(piece[i]),
+                      static_cast<uint8_t>(piece[i + 1])}]++;
+        }
+      }
+    });
+
+    std::unordered_map<std::pair<int, int>, int, pair_hash> counts;
+    for (const auto &slice : partial) {
+      for (const auto &[pair, count] : slice) {
+        counts[pair] += count;
+      }
+    }
+    return counts;
+  }
+
+  // Id of the single-byte token for byte. Trained models keep bytes as ids
+  // 0-255 outside the tree; imported tiktoken ranks put them in the tree.
+  int byte_id(uint8_t byte) {
+    int id = rbt->get_id(std::string(1, static_cast<char>(byte)));
+    return id != -1 ? id : byte;
+  }
+
+  // train and compact treat ids 0-255 as the raw bytes.
+  void require_byte_ids(const char *what) const {
+    for (int i = 0; i < 256; ++i) {
+      auto it = vocab.find(i);
+      if (it == vocab.end() || it->second.size() != 1 ||
+          static_cast<uint8_t>(it->second[0]) != i)
+        throw std::runtime_error(
+            std::string(what) +
+            " needs ids 0-255 to be the raw bytes, which an imported tiktoken "
+            "vocabulary does not keep");
+    }
+  }
+
+  // Ids are dense, so the next free id is the vocabulary size.
+  int next_token_id() const { return static_cast<int>(vocab.size()); }
+
+  template <typename Emit>
+  double timed_encode(std::string_view sample, Emit &&emit) {
+    if (sample.empty())
+      return 0;
+    auto start = std::chrono::steady_clock::now();
+    encode_each(sample, emit);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return sample.size() / 1e6 / std::max(elapsed.count(), 1e-9);
+  }
+
+  bool use_parallel(std::string_view text) const {
+    return pretokenize && text.size() >= parallel_min_bytes &&
+           WorkStealingPool::shared().size() > 1;
+  }
+
+  // Offsets [0, ..., text.size()] cutting text at pre-token boundaries into
+  // segments of roughly parallel_segment_bytes.
+  std::vector<size_t> safe_segments(std::string_view text) const {
+    std::vector<size_t> bounds{0};
+    size_t segment = std::max<size_t>(parallel_segment_bytes, 1);
+    while (text.size() - bounds.back() > segment) {
+      size_t cut =
+          PreTokenizer::find_safe_boundary(text, bounds.back() + segment);
+      if (cut == std::string_view::npos)
+        break;
+      bounds.push_back(cut);
+    }
+    bounds.push_back(text.size());
+    return bounds;
+  }
+
+  // Encodes the safe segments on the shared pool and concatenates them.
+  // Every segment starts on a piece boundary of the whole text, so the
+  // result matches the sequential path exactly.
+  std::vector<int> encode_parallel(std::string_view text) {
+    std::vector<size_t> bounds = safe_segments(text);
+    std::vector<std::vector<int>> parts(bounds.size() - 1);
+    WorkStealingPool::shared().parallel_for(parts.size(), [&](size_t i) {
+      encode_each(text.substr(bounds[i], bounds[i + 1] - bounds[i]),
+                  [&](int id) {
+                    parts[i].push_back(id);
+                    return true;
+                  });
+    });
+
+    size_t total = 0;
+    for (const auto &part : parts)
+      total += part.size();
+    std::vector<int> ids;
+    ids.reserve(total);
+    for (const auto &part : parts)
+      ids.insert(ids.end(), part.begin(), part.end());
+    return ids;
+  }
+
+  // Longest match of piece in which every candidate longer than one byte is
+  // skipped with probability dropout_prob. Bytes that start no known token
+  // are emitted as their byte id.
+  void dropout_piece(std::string_view piece, float dropout_prob,
+                     std::mt19937_64 &rng, std::vector<int> &ids) {
+    size_t pos = 0;
+    while (pos < piece.size()) {
+      int best_token_id = -1;
+      size_t best_length = 0;
+
+      for (size_t len = 1;
+           len <= std::min(static_cast<size_t>(max_depth), piece.size() - pos);
+           len++) {
+        int token_id = rbt->get_id(std::string(piece.substr(pos, len)));
+
+        if (token_id != -1) {
+          bool should_apply =
+              (len == 1) || unit_draw(rng) > dropout_prob;
+
+          if (should_apply && len > best_length) {
+            best_token_id = token_id;
+            best_length = len;
+          }
+        }
+      }
+
+      if (best_length > 0) {
+        ids.push_back(best_token_id);
+        pos += best_length;
+      } else {
+        ids.push_back(byte_id(static_cast<uint8_t>(piece[pos])));
+        pos++;
+      }
+    }
+  }
+
+  // Calls emit(id) for every token of text in order and stops early once
+  // emit returns false. Returns false if it stopped early.
+  template <typename Emit> bool encode_each(std::string_view text, Emit &&emit) {
+    if (!pretokenize)
+      return encode_piece(text, emit);
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t end = PreTokenizer::next_piece(text, pos);
+      if (!encode_piece(text.substr(pos, end - pos), emit))
+        return false;
+      pos = end;
+    }
+    return true;
+  }
+
+  // Greedy longest match of piece against the radix tree. Bytes that start
+  // no known token are emitted as their byte id.
+  template <typename Emit>
+  bool encode_piece(std::string_view piece, Emit &&emit) {
+    size_t pos = 0;
+
+    while (pos < piece.size()) {
+      CompressNode *current_node = rbt->root.get();
+      int longest_match_id = -1;
+      size_t longest_match_pos = pos;
+      size_t cursor = pos;
+
+      while (cursor < piece.size()) {
+        auto it = current_node->children.find(
+            static_cast<uint8_t>(piece[cursor]));
+        if (it == current_node->children.end())
+          break;
+
+        const std::string &prefix = it->second->prefix;
+        if (piece.compare(cursor, prefix.size(), prefix) != 0)
+          break;
+
+        current_node = it->second.get();
+        cursor += prefix.size();
+        if (current_node->value != -1) {
+          longest_match_id = current_node->value;
+          longest_match_pos = cursor;
+        }
+      }
+
+      int id;
+      if (longest_match_id != -1) {
+        id = longest_match_id;
+        pos = longest_match_pos;
+      } else {
+        id = static_cast<uint8_t>(piece[pos]);
+        pos++;
+      }
+      if (!emit(id))
+        return false;
+    }
+    return true;
+  }
+
   std::unordered_set<std::string>
   init_tech_term(const std::vector<std::string> &terms) {
     std::unordered_set<std::string> term_set;
@@ -337,11 +982,13 @@ private:
 
           // best_pair = max(pairs, key=lambda k: (pairs[k], -k[0], -k[1]))
           auto best_pair_it = std::max_element(
-              pairs.begin(), pairs.end(),
-              [](const auto &a, const auto &b) { return a.second < b.second; });
+              pairs.begin(), pairs.end(), [](const auto &a, const auto &b) {
+                return a.second < b.second ||
+                       (a.second == b.second && a.first > b.first);
+              });
           std::pair<int, int> best_pair = best_pair_it->first;
           // std::lock_guard<std::mutex> lock(mtx);
-          int new_id = 256 + merges.size();
+          int new_id = next_token_id();
           std::string merged_bytes =
               vocab[best_pair.first] + vocab[best_pair.second];
           merges[best_pair] = new_id;
@@ -409,12 +1056,18 @@ private:
     out.write(reinterpret_cast<const char *>(&node->value),
               sizeof(node->value));
 
-    size_t num_children = node->children.size();
+    std::vector<uint8_t> keys;
+    for (const auto &[byte_key, child] : node->children) {
+      keys.push_back(byte_key);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    size_t num_children = keys.size();
     out.write(reinterpret_cast<const char *>(&num_children),
               sizeof(num_children));
-    for (const auto &[byte_key, child] : node->children) {
+    for (uint8_t byte_key : keys) {
       out.write(reinterpret_cast<const char *>(&byte_key), sizeof(uint8_t));
-      serialize_tree(out, child);
+      serialize_tree(out, node->children.at(byte_key));
     }
   }
 
@@ -427,7 +1080,7 @@ private:
     int value;
     in.read(reinterpret_cast<char *>(&value), sizeof(value));
 
-    node = std::make_shared<CompressNode>(prefix);
+    node = rbt->make_node(prefix);
     node->value = value;
 
     size_t num_children;
@@ -0,0 +1,335 @@
+#include "token_shards.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+const size_t kLineBlockBytes = 64 << 20;
+const size_t kLinesPerTask = 1024;
+const size_t kFileBatch = 64;
+const size_t kFileBatchBytes = 256 << 20;
+
+struct Options {
+  std::string command;
+  std::string model;
+  std::string output;
+  std::string input;
+  std::vector<std::string> inputs;
+  int vocab_size = 0;
+  size_t min_count = 0;
+  uint32_t token_width = 4;
+  bool lines = false;
+  bool pretokenize = true;
+};
+
+void usage() {
+  std::cerr
+      << "usage:\n"
+         "  rbpe train --vocab-size N -o MODEL [--min-count K]\n"
+         "             [--no-pretokenize] [FILE...]\n"
+         "  rbpe encode -m MODEL -o PREFIX [--dtype uint16|uint32] [--lines]\n"
+         "              [FILE...]\n"
+         "  rbpe decode -m MODEL -i PREFIX\n"
+         "\n"
+         "FILE defaults to stdin ('-'). encode writes PREFIX.bin and\n"
+         "PREFIX.idx; each file is one document, or each line with --lines.\n"
+         "decode writes the documents of PREFIX back to stdout. encode and\n"
+         "decode pre-tokenize exactly when the model was trained that way.\n";
+}
+
+Options parse_args(int argc, char **argv) {
+  if (argc < 2)
+    throw std::invalid_argument("missing command");
+  Options opts;
+  opts.command = argv[1];
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::invalid_argument(arg + " needs a value");
+      return argv[++i];
+    };
+    if (arg == "-m" || arg == "--model") {
+      opts.model = value();
+    } else if (arg == "-o" || arg == "--output") {
+      opts.output = value();
+    } else if (arg == "-i" || arg == "--input") {
+      opts.input = value();
+    } else if (arg == "--vocab-size") {
+      opts.vocab_size = std::stoi(value());
+    } else if (arg == "--min-count") {
+      opts.min_count = std::stoul(value());
+    } else if (arg == "--dtype") {
+      std::string dtype = value();
+      if (dtype == "uint16")
+        opts.token_width = 2;
+      else if (dtype == "uint32")
+        opts.token_width = 4;
+      else
+        throw std::invalid_argument("unknown dtype " + dtype);
+    } else if (arg == "--lines") {
+      opts.lines = true;
+    } else if (arg == "--no-pretokenize") {
+      opts.pretokenize = false;
+    } else if (arg == "-h" || arg == "--help") {
+      usage();
+      std::exit(0);
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::invalid_argument("unknown option " + arg);
+    } else {
+      opts.inputs.push_back(arg);
+    }
+  }
+  if (opts.inputs.empty())
+    opts.inputs.push_back("-");
+  return opts;
+}
+
+// Size of the file at path, or SIZE_MAX for stdin and unreadable paths so
+// they are read on their own.
+size_t input_size(const std::string &path) {
+  std::error_code error;
+  auto size = path == "-" ? 0 : std::filesystem::file_size(path, error);
+  if (path == "-" || error)
+    return SIZE_MAX;
+  return static_cast<size_t>(size);
+}
+
+std::string read_all(const std::string &path) {
+  if (path == "-") {
+    return std::string((std::istreambuf_iterator<char>(std::cin)),
+                       std::istreambuf_iterator<char>());
+  }
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open file: " + path);
+  return std::string((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+}
+
+void load_model(RBTokenizer &tokenizer, const Options &opts) {
+  if (!opts.pretokenize)
+    throw std::invalid_argument(
+        "--no-pretokenize only applies to train; the model records its mode");
+  const std::string &path = opts.model;
+  if (path.empty())
+    throw std::invalid_argument("missing -m MODEL");
+  if (!std::ifstream(path).good())
+    throw std::runtime_error("Failed to open model: " + path);
+  tokenizer.load(path);
+}
+
+class Throughput {
+public:
+  void add(size_t bytes, size_t tokens) {
+    bytes_ += bytes;
+    tokens_ += tokens;
+  }
+
+  void report(const char *what) const {
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start_)
+                         .count();
+    seconds = std::max(seconds, 1e-9);
+    std::cerr << what << " " << bytes_ << " bytes";
+    if (tokens_ > 0)
+      std::cerr << ", " << tokens_ << " tokens";
+    std::cerr << " in " << seconds << " s (" << bytes_ / 1e6 / seconds
+              << " MB/s";
+    if (tokens_ > 0)
+      std::cerr << ", " << tokens_ / seconds << " tokens/s";
+    std::cerr << ", " << WorkStealingPool::shared().size() << " threads)"
+              << std::endl;
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  size_t bytes_ = 0;
+  size_t tokens_ = 0;
+};
+
+int run_train(const Options &opts) {
+  if (opts.vocab_size < 256)
+    throw std::invalid_argument("--vocab-size must be >= 256");
+  if (opts.output.empty())
+    throw std::invalid_argument("missing -o MODEL");
+
+  std::string corpus;
+  for (const auto &path : opts.inputs)
+    corpus += read_all(path);
+  if (corpus.empty())
+    throw std::invalid_argument("Corpus cannot be empty");
+
+  Throughput throughput;
+  RBTokenizer tokenizer(0, {}, opts.pretokenize);
+  tokenizer.train(corpus, opts.vocab_size);
+  if (opts.min_count > 0) {
+    CompactionReport report = tokenizer.compact(corpus, opts.min_count);
+    std::cerr << "compacted vocab " << report.vocab_before << " -> "
+              << report.vocab_after << ", tree " << report.tree_bytes_before
+              << " -> " << report.tree_bytes_after << " bytes" << std::endl;
+  }
+  tokenizer.save(opts.output);
+  throughput.add(corpus.size(), 0);
+  throughput.report("trained on");
+  return 0;
+}
+
+// Encodes every line of in (newline included) as its own document. Input is
+// processed in blocks so memory stays bounded on arbitrarily large files.
+void encode_lines(RBTokenizer &tokenizer, std::istream &in,
+                  TokenShardWriter &writer, Throughput &throughput) {
+  std::string block;
+  std::vector<char> buffer(kLineBlockBytes);
+  std::vector<std::string_view> docs;
+  std::vector<std::vector<int>> ids;
+
+  while (true) {
+    in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    size_t got = static_cast<size_t>(in.gcount());
+    block.append(buffer.data(), got);
+    bool eof = got < buffer.size();
+
+    size_t usable = eof ? block.size() : block.rfind('\n') + 1;
+    if (!eof && usable == 0)
+      continue; // a single line longer than the block; keep reading
+
+    docs.clear();
+    std::string_view view(block.data(), usable);
+    size_t start = 0;
+    while (start < view.size()) {
+      size_t end = view.find('\n', start);
+      end = end == std::string_view::npos ? view.size() : end + 1;
+      docs.push_back(view.substr(start, end - start));
+      start = end;
+    }
+
+    ids.resize(docs.size());
+    size_t groups = (docs.size() + kLinesPerTask - 1) / kLinesPerTask;
+    WorkStealingPool::shared().parallel_for(groups, [&](size_t g) {
+      size_t end = std::min(docs.size(), (g + 1) * kLinesPerTask);
+      for (size_t i = g * kLinesPerTask; i < end; ++i)
+        tokenizer.encode_into(docs[i], ids[i]);
+    });
+    for (size_t i = 0; i < docs.size(); ++i) {
+      writer.add_document(ids[i]);
+      throughput.add(docs[i].size(), ids[i].size());
+    }
+
+    block.erase(0, usable);
+    if (eof)
+      break;
+  }
+}
+
+int run_encode(const Options &opts) {
+  if (opts.output.empty())
+    throw std::invalid_argument("missing -o PREFIX");
+  RBTokenizer tokenizer;
+  load_model(tokenizer, opts);
+  if (opts.token_width == 2 && tokenizer.vocab.size() > 0x10000)
+    throw std::invalid_argument("vocabulary does not fit in uint16");
+
+  TokenShardWriter writer(opts.output, opts.token_width);
+  Throughput throughput;
+
+  if (opts.lines) {
+    for (const auto &path : opts.inputs) {
+      if (path == "-") {
+        encode_lines(tokenizer, std::cin, writer, throughput);
+        continue;
+      }
+      std::ifstream file(path, std::ios::binary);
+      if (!file.is_open())
+        throw std::runtime_error("Failed to open file: " + path);
+      encode_lines(tokenizer, file, writer, throughput);
+    }
+  } else {
+    // Small files run side by side, at most kFileBatchBytes of them in
+    // memory at once. A file at least that large is encoded alone, split
+    // into segments by encode.
+    for (size_t first = 0; first < opts.inputs.size();) {
+      size_t count = 0;
+      size_t batch_bytes = 0;
+      while (first + count < opts.inputs.size() && count < kFileBatch) {
+        size_t size =
+            std::min(input_size(opts.inputs[first + count]), kFileBatchBytes);
+        if (count > 0 && batch_bytes + size > kFileBatchBytes)
+          break;
+        batch_bytes += size;
+        count++;
+      }
+      std::vector<size_t> bytes(count);
+      std::vector<std::vector<int>> ids(count);
+      WorkStealingPool::shared().parallel_for(count, [&](size_t i) {
+        std::string text = read_all(opts.inputs[first + i]);
+        bytes[i] = text.size();
+        ids[i] = tokenizer.encode(text);
+      });
+      for (size_t i = 0; i < count; ++i) {
+        writer.add_document(ids[i]);
+        throughput.add(bytes[i], ids[i].size());
+      }
+      first += count;
+    }
+  }
+
+  writer.close();
+  throughput.report("encoded");
+  return 0;
+}
+
+int run_decode(const Options &opts) {
+  if (opts.input.empty())
+    throw std::invalid_argument("missing -i PREFIX");
+  RBTokenizer tokenizer;
+  load_model(tokenizer, opts);
+
+  TokenShardReader reader(opts.input);
+  Throughput throughput;
+  std::vector<int> ids;
+  for (size_t i = 0; i < reader.document_count(); ++i) {
+    reader.read_document(i, ids);
+    std::string text = tokenizer.decode(ids);
+    std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+    throughput.add(text.size(), ids.size());
+  }
+  std::cout.flush();
+  throughput.report("decoded");
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::ios::sync_with_stdio(false);
+  try {
+    Options opts = parse_args(argc, argv);
+    if (opts.command == "train")
+      return run_train(opts);
+    if (opts.command == "encode")
+      return run_encode(opts);
+    if (opts.command == "decode")
+      return run_decode(opts);
+    throw std::invalid_argument("unknown command " + opts.command);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "rbpe: " << e.what() << std::endl;
+    usage();
+    return 2;
+  } catch (const std::exception &e) {
+    std::cerr << "rbpe: " << e.what() << std::endl;
+    return 1;
+  }
+}
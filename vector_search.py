@@ -23,6 +23,7 @@ class VectorSearchSystem:
         self.index: Optional[faiss.Index] = None
         self.problems: List[Dict] = []
         self.token_cache: Dict[str, List[int]] = {}
+        self.token_index = rbpe_tokenizer.TokenOverlapIndex()
         self.id_map = []
 
     def _load_tokenizer(
@@ -44,6 +45,7 @@ class VectorSearchSystem:
 
     def create_embeddings(self, problems: List[Dict], batch_size: int = 64):
         self.problems = problems
+        self.token_index = rbpe_tokenizer.TokenOverlapIndex()
         embeddings = []
         token_store = []
 
@@ -58,33 +60,36 @@ class VectorSearchSystem:
                 print(f"Skipping invalid ID: {p.get('id', 'MISSING')}")
                 continue
 
-        for i in range(0, len(problems), batch_size):
-            batch_indices = valid_indexes[i : i + batch_size]
-            batch = [problems[idx] for idx in batch_indices]
-            batch_tokens = []
-
-            for problem in batch:
-                if "content" in problem and problem["content"]:
-                    text = f"{problem['title']} [SEP] {problem['content']}"
-                    tokens = self.tokenizer.encode(text)
-                else:
-                    tokens = self.tokenizer.encode_with_dropout(
-                        problem["title"], dropout_prob=0.1
-                    )
-
+        # Tokenization and decode run on native threads a few batches ahead,
+        # overlapping with the embedder working on the current batch.
+        valid_problems = [problems[idx] for idx in valid_indexes]
+        items = (
+            f"{problem['title']} [SEP] {problem['content']}"
+            if "content" in problem and problem["content"]
+            else (problem["title"], 0.1)
+            for problem in valid_problems
+        )
+        pipeline = rbpe_tokenizer.TokenizePipeline(self.tokenizer, max_in_flight=4)
+
+        for start, batch in zip(
+            range(0, len(valid_problems), batch_size),
+            pipeline.map(items, batch_size=batch_size),
+        ):
+            for problem, tokens in zip(
+                valid_problems[start : start + batch_size], batch.tokens
+            ):
                 self.token_cache[problem["id"]] = tokens
-                batch_tokens.append(tokens)
+                self.token_index.add(str(problem["id"]), tokens)
 
-            batch_texts = [self.tokenizer.decode(tokens) for tokens in batch_tokens]
             batch_embeddings = self.embedder.encode(
-                batch_texts,
+                batch.texts,
                 batch_size=batch_size,
                 convert_to_tensor=False,
                 normalize_embeddings=True,
             )
 
             embeddings.extend(batch_embeddings)
-            token_store.extend(batch_tokens)
+            token_store.extend(batch.tokens)
 
         dim = embeddings[0].shape[0]
 
@@ -103,11 +108,13 @@ class VectorSearchSystem:
         faiss.write_index(
             self.index, os.path.join(self.persist_dir, "leetcode_index.faiss")
         )
+        self.token_index.save(os.path.join(self.persist_dir, "token_index.bin"))
 
     def load_embeddings(self):
         """Load persisted embeddings and index"""
         embeddings_path = os.path.join(self.persist_dir, "embeddings.npy")
         index_path = os.path.join(self.persist_dir, "leetcode_index.faiss")
+        token_index_path = os.path.join(self.persist_dir, "token_index.bin")
 
         if os.path.exists(embeddings_path):
             self.embeddings = np.load(embeddings_path)
@@ -115,28 +122,20 @@ class VectorSearchSystem:
             self.id_map = [
                 p["id"] for p in self.problems if p["id"] in self.token_cache
             ]
+        if os.path.exists(token_index_path):
+            self.token_index.load(token_index_path)
 
     def query(self, question: str, top_k: int = 5) -> List[Dict]:
         query_tokens = self.tokenizer.encode(question)
 
-        valid_cache = {
-            p["id"]: self.token_cache[p["id"]]
-            for p in self.problems
-            if p["id"] in self.token_cache
+        candidate_ids = {
+            pid for pid, _ in self.token_index.top_k(query_tokens, top_k * 3)
         }
 
-        token_overlap_scores = [
-            (pid, len(set(query_tokens) & set(tokens)))
-            for pid, tokens in valid_cache.items()
-        ]
-        token_overlap_scores.sort(key=lambda x: x[1], reverse=True)
-
-        candidate_ids = [str(pid) for pid, _ in token_overlap_scores[: top_k * 3]]
-
         valid_indices = [
             idx
             for idx, mapped_id in enumerate(self.id_map)
-            if mapped_id in set(candidate_ids)
+            if mapped_id in candidate_ids
         ]
 
         if not valid_indices: